@@ -3,8 +3,12 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdarg.h>
 
 #include "btree.h"
+#include "btree_probes.h"
 
 #ifdef DEBUG
 #define DUMP(format, ...) (fprintf(stderr, format, ##__VA_ARGS__))
@@ -14,47 +18,246 @@
 
 #define COLOR(node) (((node) == NULL)? BTREE_BLACK : (node)->color)
 
+/*
+ * Counts one in 'heat_sample' accesses to a node when heat tracking is on.
+ * Lookups may run concurrently under a shared lock, so the counters are
+ * relaxed atomics; a hit lost to a race only skews the sample.
+ */
+static void record_hit(BTree *tree, Node *node)
+{
+  unsigned sample = __atomic_load_n(&tree->heat_sample, __ATOMIC_RELAXED);
+  if (sample == 0 || node == NULL)
+    return;
+  if (__atomic_add_fetch(&tree->heat_ticks, 1, __ATOMIC_RELAXED) % sample != 0)
+    return;
+  uint32_t hits = __atomic_load_n(&node->hits, __ATOMIC_RELAXED);
+  while (hits != UINT32_MAX &&
+         !__atomic_compare_exchange_n(&node->hits, &hits, hits + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+#define KEY_COMPARE(a, b) (((a) > (b)) - ((a) < (b)))
+
+#define FIND_INLINE_KEY(node, k, field) \
+  while ((node) != NULL && (node)->key.field != (k)) \
+    (node) = ((k) < (node)->key.field)? (node)->left : (node)->right
+
 BTree* btree_create(int (*cmp) (void *, void *))
 {
   BTree *t = (BTree*)malloc(sizeof(BTree));
   if (t == NULL)
     return NULL;
   t->cmp = cmp;
+  t->key_type = BTREE_KEY_POINTER;
+  t->prefix = NULL;
+  t->augment = NULL;
   t->root = NULL;
+  t->size = 0;
+  t->allocator.alloc = NULL;
+  t->allocator.free = NULL;
+  t->allocator.release = NULL;
+  t->allocator.ctx = NULL;
+  t->allocator.footprint = NULL;
+  t->black_height = 0;
+  t->heat_sample = 0;
+  t->heat_ticks = 0;
+  t->first = NULL;
+  t->last = NULL;
   return t;
 }
 
+BTree* btree_create_augmented(int (*cmp) (void *, void *), void (*augment) (Node *))
+{
+  BTree *t = btree_create(cmp);
+  if (t == NULL)
+    return NULL;
+  t->augment = augment;
+  return t;
+}
+
+BTree* btree_create_keyed(BTreeKeyType key_type)
+{
+  // The other key types order elements with a compare function.
+  if (key_type != BTREE_KEY_INT64 && key_type != BTREE_KEY_UINT64 && key_type != BTREE_KEY_DOUBLE)
+    return NULL;
+  BTree *t = btree_create(NULL);
+  if (t == NULL)
+    return NULL;
+  t->key_type = key_type;
+  return t;
+}
+
+BTree* btree_create_prefixed(int (*cmp) (void *, void *), uint64_t (*prefix) (void *))
+{
+  BTree *t = btree_create(cmp);
+  if (t == NULL)
+    return NULL;
+  t->key_type = BTREE_KEY_PREFIX;
+  t->prefix = prefix;
+  return t;
+}
+
+uint64_t btree_string_prefix(void *data)
+{
+  const unsigned char *s = (const unsigned char*)data;
+  uint64_t prefix = 0;
+  int i = 0;
+  for (; i < 8 && s[i] != '\0'; ++i)
+    prefix = (prefix << 8) | s[i];
+  return prefix << (8 * (8 - i));
+}
+
+static BTreeKey load_key(BTree *t, void *data)
+{
+  BTreeKey key;
+  switch (t->key_type) {
+  case BTREE_KEY_INT64:
+    key.i64 = *(int64_t*)data;
+    break;
+  case BTREE_KEY_UINT64:
+    key.u64 = *(uint64_t*)data;
+    break;
+  case BTREE_KEY_DOUBLE:
+    key.f64 = *(double*)data;
+    break;
+  case BTREE_KEY_PREFIX:
+    key.u64 = t->prefix(data);
+    break;
+  default:
+    key.u64 = 0;
+  }
+  return key;
+}
+
+static int compare(BTree *t, BTreeKey key, void *data, Node *n)
+{
+  switch (t->key_type) {
+  case BTREE_KEY_INT64:
+    return KEY_COMPARE(key.i64, n->key.i64);
+  case BTREE_KEY_UINT64:
+    return KEY_COMPARE(key.u64, n->key.u64);
+  case BTREE_KEY_DOUBLE:
+    return KEY_COMPARE(key.f64, n->key.f64);
+  case BTREE_KEY_PREFIX:
+    if (key.u64 != n->key.u64)
+      return (key.u64 < n->key.u64)? -1 : 1;
+    return (*(t->cmp))(data, n->data);
+  default:
+    return (*(t->cmp))(data, n->data);
+  }
+}
+
+void btree_set_allocator(BTree *t, BTreeAllocator allocator)
+{
+  t->allocator = allocator;
+}
+
+static Node* node_alloc(BTree *t)
+{
+  Node *n = NULL;
+  if (t->allocator.alloc == NULL)
+    n = (Node*)malloc(sizeof(Node));
+  else
+    n = (Node*)t->allocator.alloc(t->allocator.ctx, sizeof(Node));
+  BTREE_PROBE2(node_alloc, t, n);
+  return n;
+}
+
+Node* btree_node_alloc(BTree *tree)
+{
+  return node_alloc(tree);
+}
+
+static void node_free(BTree *t, Node *n)
+{
+  BTREE_PROBE2(node_free, t, n);
+  if (t->allocator.free == NULL)
+    free(n);
+  else
+    t->allocator.free(t->allocator.ctx, n);
+}
+
+int btree_compare(BTree *t, void *data, Node *n)
+{
+  return compare(t, load_key(t, data), data, n);
+}
+
 bool btree_isempty(BTree *t)
 {
   return t->root == NULL;
 }
 
-static Node* insert_helper(BTree *t, Node **node, Node *parent, void *data)
+size_t btree_size(BTree *t)
+{
+  return t->size;
+}
+
+int btree_black_height(BTree *t)
+{
+  return t->black_height;
+}
+
+/* Bytes malloc takes for a 'size'-byte block: a size header, rounded to 16. */
+static size_t malloc_chunk(size_t size)
+{
+  size_t chunk = (size + sizeof(size_t) + 15) & ~(size_t)15;
+  return (chunk < 32)? 32 : chunk;
+}
+
+BTreeMemory btree_memory_usage(BTree *t)
+{
+  BTreeMemory res;
+  res.node_bytes = t->size * sizeof(Node);
+  size_t total = malloc_chunk(sizeof(BTree));
+  if (t->allocator.footprint != NULL)
+    total += t->allocator.footprint(t->allocator.ctx);
+  else
+    total += t->size * malloc_chunk(sizeof(Node));
+  res.overhead_bytes = (total > res.node_bytes)? total - res.node_bytes : 0;
+  res.bytes_per_element = (t->size == 0)? 0.0 : (double)total / t->size;
+  return res;
+}
+
+static Node* insert_helper(BTree *t, Node **node, Node *parent, void *data, BTreeKey key,
+    Node **existing)
 {
   if ((*node) == NULL) {
-    Node *new_node = (Node*)malloc(sizeof(Node)); 
+    Node *new_node = node_alloc(t); 
     if (new_node == NULL) {
       return NULL;
     }
     *node = new_node;
     (*node)->data = data; 
+    (*node)->key = key;
     (*node)->parent = parent;
     (*node)->left = NULL;
     (*node)->right = NULL;  
+    (*node)->hits = 0;
     return *node;
   } 
-  int cmp_result = (*(t->cmp))(data, (*node)->data);
+  int cmp_result = compare(t, key, data, *node);
   if (cmp_result == 0) {
+    *existing = *node;
     return NULL;
   } else if (cmp_result > 0) {
-    return insert_helper(t, &((*node)->right), *node, data);
+    return insert_helper(t, &((*node)->right), *node, data, key, existing);
   } else {
-    return insert_helper(t, &((*node)->left), *node, data); 
+    return insert_helper(t, &((*node)->left), *node, data, key, existing); 
   }
 }
 
+static void augment_path(BTree *tree, Node *n)
+{
+  if (tree->augment == NULL)
+    return;
+  for (; n != NULL; n = n->parent)
+    tree->augment(n);
+}
+
 static void left_rotation(BTree *tree, Node *x)
 {
+  BTREE_PROBE2(rotate_left, tree, x);
   Node *y = x->right;
   x->right = y->left;
   if (y->left != NULL) 
@@ -70,10 +273,15 @@ static void left_rotation(BTree *tree, Node *x)
   }
   y->left = x;
   x->parent = y;
+  if (tree->augment != NULL) {
+    tree->augment(x);
+    tree->augment(y);
+  }
 }
 
 static void right_rotation(BTree *tree, Node *y)
 {
+  BTREE_PROBE2(rotate_right, tree, y);
   Node *x = y->left;
   y->left = x->right;
   if (x->right != NULL) 
@@ -89,17 +297,21 @@ static void right_rotation(BTree *tree, Node *y)
   }
   x->right = y;
   y->parent = x;
+  if (tree->augment != NULL) {
+    tree->augment(y);
+    tree->augment(x);
+  }
 }
 
-bool btree_insert(BTree *tree, void *data)
-{ 
-  if (btree_member(tree, data))
-    return true;
-  Node *x = NULL;
-  if ((x = insert_helper(tree, &tree->root, NULL, data)) == NULL) {
-    return false;
-  } 
+static void insert_fixup(BTree *tree, Node *x)
+{
+  tree->size += 1;
   x->color = BTREE_RED;
+  if (tree->first == NULL || (x->parent == tree->first && x == tree->first->left))
+    tree->first = x;
+  if (tree->last == NULL || (x->parent == tree->last && x == tree->last->right))
+    tree->last = x;
+  augment_path(tree, x);
   while (COLOR(x->parent) == BTREE_RED) {
     Node *p = x->parent;
     Node *pp = p->parent;
@@ -110,6 +322,7 @@ bool btree_insert(BTree *tree, void *data)
         y->color = BTREE_BLACK;
         pp->color = BTREE_RED;
         x = pp;
+        BTREE_PROBE2(insert_recolor, tree, pp);
       } else {
         if (x == p->right) {
           x = x->parent;
@@ -128,6 +341,7 @@ bool btree_insert(BTree *tree, void *data)
         y->color = BTREE_BLACK;
         pp->color = BTREE_RED;
         x = pp;
+        BTREE_PROBE2(insert_recolor, tree, pp);
       } else {
         if (x == p->left) {
           x = p;
@@ -141,30 +355,97 @@ bool btree_insert(BTree *tree, void *data)
       } 
     }
   }
+  if (tree->root->color == BTREE_RED)
+    tree->black_height += 1;
   tree->root->color = BTREE_BLACK;
+}
+
+bool btree_insert(BTree *tree, void *data)
+{ 
+  Node *x = NULL;
+  Node *existing = NULL;
+  if ((x = insert_helper(tree, &tree->root, NULL, data, load_key(tree, data), &existing)) == NULL) {
+    return existing != NULL;
+  } 
+  insert_fixup(tree, x);
   return true;
 }
 
-static BTreeIterator find_helper(BTree *tree, Node *node, void *data)
+static BTreeIterator find_helper(BTree *tree, Node *node, void *data, BTreeKey key)
 {
   if (node == NULL) {
     BTreeIterator res = {tree, NULL};
     return res;
   }
-  int cmp_result = (*(tree->cmp))(data, node->data);
+  int cmp_result = compare(tree, key, data, node);
   if (cmp_result == 0) {
     BTreeIterator res = {tree, node};
     return res;
   }
   else if (cmp_result < 0)
-    return find_helper(tree, node->left, data);
+    return find_helper(tree, node->left, data, key);
   else
-    return find_helper(tree, node->right, data);
+    return find_helper(tree, node->right, data, key);
 }
 
 BTreeIterator btree_find(BTree *tree, void *data)
 {
-  return find_helper(tree, tree->root, data);
+  Node *node = tree->root;
+  switch (tree->key_type) {
+  case BTREE_KEY_INT64: {
+    int64_t k = *(int64_t*)data;
+    FIND_INLINE_KEY(node, k, i64);
+    break;
+  }
+  case BTREE_KEY_UINT64: {
+    uint64_t k = *(uint64_t*)data;
+    FIND_INLINE_KEY(node, k, u64);
+    break;
+  }
+  case BTREE_KEY_DOUBLE: {
+    double k = *(double*)data;
+    FIND_INLINE_KEY(node, k, f64);
+    break;
+  }
+  case BTREE_KEY_PREFIX: {
+    uint64_t k = tree->prefix(data);
+    while (node != NULL) {
+      int cmp_result = (k != node->key.u64)? ((k < node->key.u64)? -1 : 1)
+                                            : (*(tree->cmp))(data, node->data);
+      if (cmp_result == 0)
+        break;
+      node = (cmp_result < 0)? node->left : node->right;
+    }
+    break;
+  }
+  default:
+    node = find_helper(tree, tree->root, data, load_key(tree, data)).node;
+  }
+  record_hit(tree, node);
+  BTreeIterator res = {tree, node};
+  return res;
+}
+
+BTreeIterator btree_lower_bound(BTree *tree, void *data)
+{
+  BTreeKey key = load_key(tree, data);
+  Node *node = tree->root;
+  Node *bound = NULL;
+  while (node != NULL) {
+    int cmp_result = compare(tree, key, data, node);
+    if (cmp_result == 0) {
+      bound = node;
+      break;
+    }
+    if (cmp_result < 0) {
+      bound = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  BTreeIterator res = {tree, bound};
+  return res;
 }
 
 bool btree_member(BTree *tree, void *data)
@@ -182,10 +463,49 @@ static Node* down_to_leftmost_child(Node *t)
     return t;
 }
 
+static Node* down_to_rightmost_child(Node *t)
+{
+  if (t == NULL)
+    return NULL;
+  while (t->right != NULL)
+    t = t->right;
+  return t;
+}
+
+static Node* up_to_first_right(Node *t)
+{
+  if (t == NULL || t->parent == NULL)
+    return NULL;
+  if (t->parent->right == t)
+    return up_to_first_right(t->parent);
+  return t->parent;
+}
+
+static Node* successor(Node *node)
+{
+  if (node->right != NULL)
+    return down_to_leftmost_child(node->right);
+  if (node->parent == NULL)
+    return NULL;
+  if (node->parent->left == node)
+    return node->parent;
+  return up_to_first_right(node->parent);
+}
+
+static Node* predecessor(Node *t)
+{
+  if (t->left != NULL)
+    return down_to_rightmost_child(t->left);
+  while (t->parent != NULL && t->parent->left == t)
+    t = t->parent;
+  return t->parent;
+}
+
 static void remove_fixup(BTree *tree, Node *x, Node *yp)
 {
   while (x != tree->root && COLOR(x) == BTREE_BLACK) {
     Node *xp = (x == NULL)? yp : x->parent;
+    BTREE_PROBE2(remove_fixup, tree, xp);
     if (x == xp->left) {
       Node *w = xp->right; 
       if (COLOR(w) == BTREE_RED) {
@@ -197,6 +517,8 @@ static void remove_fixup(BTree *tree, Node *x, Node *yp)
       if (COLOR(w->left) == BTREE_BLACK && COLOR(w->right) == BTREE_BLACK) {
         w->color = BTREE_RED;
         x = xp;
+        if (x == tree->root && x->color == BTREE_BLACK)
+          tree->black_height -= 1;
       } else {
         if (COLOR(w->right) == BTREE_BLACK) {
           w->left->color = BTREE_BLACK;
@@ -221,6 +543,8 @@ static void remove_fixup(BTree *tree, Node *x, Node *yp)
       if (COLOR(w->right) == BTREE_BLACK && COLOR(w->left) == BTREE_BLACK) {
         w->color = BTREE_RED;
         x = xp;
+        if (x == tree->root && x->color == BTREE_BLACK)
+          tree->black_height -= 1;
       } else {
         if (COLOR(w->left) == BTREE_BLACK) {
           w->right->color = BTREE_BLACK;
@@ -240,16 +564,21 @@ static void remove_fixup(BTree *tree, Node *x, Node *yp)
     x->color = BTREE_BLACK;
 }
 
-void btree_remove(BTreeIterator it)
+/*
+ * Unlinks 'z' and returns the node to free. That is z itself unless z has
+ * two children, in which case its successor's element is moved into z.
+ */
+static Node* unlink_node(BTree *tree, Node *z)
 {
-  Node *z = it.node;
-  if (z == NULL)
-    return;
+  if (z == tree->first)
+    tree->first = successor(z);
+  if (z == tree->last)
+    tree->last = predecessor(z);
   Node *y = NULL;
   if (z->left == NULL || z->right == NULL)
     y = z;
   else
-    y = down_to_leftmost_child(z);
+    y = down_to_leftmost_child(z->right);
   Node *x = NULL;
   if (y->left != NULL)
     x = y->left;
@@ -258,72 +587,576 @@ void btree_remove(BTreeIterator it)
   if (x != NULL)
     x->parent = y->parent;
   if (y->parent == NULL) {
-    it.tree->root = x;
+    tree->root = x;
   } else {
     if (y == y->parent->left) 
       y->parent->left = x;
     else
       y->parent->right = x;
   }
-  if (y != z)
+  if (y != z) {
     z->data = y->data;
+    z->key = y->key;
+    z->hits = y->hits;
+    if (tree->last == y)
+      tree->last = z;
+  }
+  augment_path(tree, y->parent);
   if (COLOR(y) == BTREE_BLACK)
-    remove_fixup(it.tree, x, y->parent);
-  free(y);
+    remove_fixup(tree, x, y->parent);
+  tree->size -= 1;
+  if (tree->root == NULL)
+    tree->black_height = 0;
+  return y;
+}
+
+void btree_remove(BTreeIterator it)
+{
+  if (it.node == NULL)
+    return;
+  node_free(it.tree, unlink_node(it.tree, it.node));
 }
 
 BTreeIterator btree_begin(BTree *tree)
 {
-  BTreeIterator res = {tree, down_to_leftmost_child(tree->root)};
+  record_hit(tree, tree->first);
+  BTreeIterator res = {tree, tree->first};
   return res;
 }
 
-static Node* up_to_first_right(Node *t)
+void* btree_first(BTree *tree)
 {
-  if (t == NULL || t->parent == NULL)
+  return (tree->first == NULL)? NULL : tree->first->data;
+}
+
+void* btree_last(BTree *tree)
+{
+  return (tree->last == NULL)? NULL : tree->last->data;
+}
+
+void* btree_pop_first(BTree *tree)
+{
+  if (tree->first == NULL)
     return NULL;
-  if (t->parent->right == t)
-    return up_to_first_right(t->parent);
-  return t->parent;
+  void *data = tree->first->data;
+  BTreeIterator it = {tree, tree->first};
+  btree_remove(it);
+  return data;
+}
+
+void* btree_pop_last(BTree *tree)
+{
+  if (tree->last == NULL)
+    return NULL;
+  void *data = tree->last->data;
+  BTreeIterator it = {tree, tree->last};
+  btree_remove(it);
+  return data;
 }
 
 BTreeIterator btree_next(BTreeIterator it)
 {
-  Node *node = it.node;
-  if (node->right != NULL) {
-    BTreeIterator res = {it.tree, down_to_leftmost_child(node->right)};
-    return res;
+  Node *next = successor(it.node);
+  record_hit(it.tree, next);
+  BTreeIterator res = {it.tree, next};
+  return res;
+}
+
+bool btree_has_more(BTreeIterator it)
+{
+  return successor(it.node) != NULL;
+}
+
+BTreeIterator btree_rbegin(BTree *tree)
+{
+  record_hit(tree, tree->last);
+  BTreeIterator res = {tree, tree->last};
+  return res;
+}
+
+BTreeIterator btree_end(BTree *tree)
+{
+  BTreeIterator res = {tree, NULL};
+  return res;
+}
+
+BTreeIterator btree_prev(BTreeIterator it)
+{
+  Node *prev = (it.node == NULL)? it.tree->last : predecessor(it.node);
+  record_hit(it.tree, prev);
+  BTreeIterator res = {it.tree, prev};
+  return res;
+}
+
+bool btree_has_prev(BTreeIterator it)
+{
+  return ((it.node == NULL)? it.tree->last : predecessor(it.node)) != NULL;
+}
+
+#define CHILD(node, dir) ((dir)? (node)->right : (node)->left)
+
+/* Rotates 'n' towards 'dir' (0 is left): its child on the other side takes its place. */
+static void rotate(BTree *tree, Node *n, int dir)
+{
+  if (dir == 0)
+    left_rotation(tree, n);
+  else
+    right_rotation(tree, n);
+}
+
+/*
+ * Resolves a red 'x' under a red parent on the way down. Earlier color
+ * flips guarantee that the uncle is black, so one or two rotations at the
+ * grandparent suffice and nothing above it changes.
+ */
+static void split_red_pair(BTree *tree, Node *x)
+{
+  Node *p = x->parent;
+  if (COLOR(p) != BTREE_RED)
+    return;
+  Node *g = p->parent;
+  int dir = (p == g->right);
+  if ((x == p->right) != dir) {
+    rotate(tree, p, dir);
+    p = x;
   }
-  if (node->parent == NULL) {
-    BTreeIterator res = {it.tree, NULL};
-    return res;
+  p->color = BTREE_BLACK;
+  g->color = BTREE_RED;
+  rotate(tree, g, !dir);
+}
+
+bool btree_insert_topdown(BTree *tree, void *data)
+{
+  BTreeKey key = load_key(tree, data);
+  Node *n = tree->root;
+  Node *parent = NULL;
+  int cmp_result = 0;
+  while (n != NULL) {
+    if (COLOR(n->left) == BTREE_RED && COLOR(n->right) == BTREE_RED) {
+      n->left->color = BTREE_BLACK;
+      n->right->color = BTREE_BLACK;
+      if (n == tree->root) {
+        tree->black_height += 1;
+      } else {
+        n->color = BTREE_RED;
+        split_red_pair(tree, n);
+      }
+    }
+    cmp_result = compare(tree, key, data, n);
+    if (cmp_result == 0)
+      return true;
+    parent = n;
+    n = (cmp_result < 0)? n->left : n->right;
+  }
+  Node *x = node_alloc(tree);
+  if (x == NULL)
+    return false;
+  x->data = data;
+  x->key = key;
+  x->parent = parent;
+  x->left = NULL;
+  x->right = NULL;
+  x->hits = 0;
+  x->color = BTREE_RED;
+  if (parent == NULL)
+    tree->root = x;
+  else if (cmp_result < 0)
+    parent->left = x;
+  else
+    parent->right = x;
+  tree->size += 1;
+  if (tree->first == NULL || (parent == tree->first && x == parent->left))
+    tree->first = x;
+  if (tree->last == NULL || (parent == tree->last && x == parent->right))
+    tree->last = x;
+  augment_path(tree, x);
+  split_red_pair(tree, x);
+  if (tree->root->color == BTREE_RED)
+    tree->black_height += 1;
+  tree->root->color = BTREE_BLACK;
+  return true;
+}
+
+bool btree_remove_topdown(BTree *tree, void *data)
+{
+  if (tree->root == NULL)
+    return false;
+  BTreeKey key = load_key(tree, data);
+  Node *q = tree->root;
+  Node *f = NULL;
+  for (;;) {
+    // Once the element is found, descend to its predecessor.
+    int cmp_result = (f == NULL)? compare(tree, key, data, q) : 1;
+    if (cmp_result == 0)
+      f = q;
+    int dir = (cmp_result > 0);
+    Node *next = CHILD(q, dir);
+    // Make sure q is red before stepping below it; p is red or the root.
+    if (COLOR(q) == BTREE_BLACK && COLOR(next) == BTREE_BLACK) {
+      Node *p = q->parent;
+      if (COLOR(CHILD(q, !dir)) == BTREE_RED) {
+        Node *r = CHILD(q, !dir);
+        rotate(tree, q, dir);
+        r->color = BTREE_BLACK;
+        q->color = BTREE_RED;
+      } else if (p != NULL) {
+        int last = (q == p->right);
+        Node *s = CHILD(p, !last);
+        if (COLOR(s->left) == BTREE_BLACK && COLOR(s->right) == BTREE_BLACK) {
+          if (p == tree->root)
+            tree->black_height -= 1;
+          p->color = BTREE_BLACK;
+          s->color = BTREE_RED;
+          q->color = BTREE_RED;
+        } else {
+          if (COLOR(CHILD(s, last)) == BTREE_RED)
+            rotate(tree, s, !last);
+          rotate(tree, p, last);
+          Node *t = p->parent;
+          q->color = BTREE_RED;
+          t->color = BTREE_RED;
+          t->left->color = BTREE_BLACK;
+          t->right->color = BTREE_BLACK;
+        }
+      }
+    }
+    if (next == NULL)
+      break;
+    q = next;
+  }
+
+  if (f != NULL) {
+    // q is red unless it is the root, so unlinking it needs no fixup.
+    if (q == f) {
+      if (tree->first == q)
+        tree->first = successor(q);
+      if (tree->last == q)
+        tree->last = predecessor(q);
+    } else {
+      if (tree->first == q)
+        tree->first = f;
+      f->data = q->data;
+      f->key = q->key;
+      f->hits = q->hits;
+    }
+    Node *x = (q->left != NULL)? q->left : q->right;
+    if (x != NULL)
+      x->parent = q->parent;
+    if (q->parent == NULL)
+      tree->root = x;
+    else if (q == q->parent->left)
+      q->parent->left = x;
+    else
+      q->parent->right = x;
+    augment_path(tree, q->parent);
+    tree->size -= 1;
+    node_free(tree, q);
   }
-  if (node->parent->left == node) {
-    BTreeIterator res = {it.tree, node->parent};
+  if (tree->root == NULL)
+    tree->black_height = 0;
+  else
+    tree->root->color = BTREE_BLACK;
+  return f != NULL;
+}
+
+static Node* up_to_first_left(Node *t)
+{
+  while (t->parent != NULL && t->parent->left == t)
+    t = t->parent;
+  return t->parent;
+}
+
+BTreeIterator btree_insert_hint(BTree *tree, BTreeIterator hint, void *data)
+{
+  Node *n = (hint.node == NULL)? tree->last : hint.node;
+  Node *x = NULL;
+  Node *existing = NULL;
+  BTreeKey key = load_key(tree, data);
+  int cmp_result = (n == NULL)? 0 : compare(tree, key, data, n);
+  if (n == NULL) {
+    x = insert_helper(tree, &tree->root, NULL, data, key, &existing);
+  } else if (cmp_result == 0) {
+    BTreeIterator res = {tree, n};
     return res;
+  } else if (cmp_result > 0) {
+    while (n != tree->last) {
+      Node *bound = up_to_first_right(n);
+      if (bound == NULL)
+        break;
+      cmp_result = compare(tree, key, data, bound);
+      if (cmp_result == 0) {
+        BTreeIterator res = {tree, bound};
+        return res;
+      }
+      if (cmp_result < 0)
+        break;
+      n = bound;
+    }
+    x = insert_helper(tree, &n->right, n, data, key, &existing);
+  } else {
+    while (n != tree->first) {
+      Node *bound = up_to_first_left(n);
+      if (bound == NULL)
+        break;
+      cmp_result = compare(tree, key, data, bound);
+      if (cmp_result == 0) {
+        BTreeIterator res = {tree, bound};
+        return res;
+      }
+      if (cmp_result > 0)
+        break;
+      n = bound;
+    }
+    x = insert_helper(tree, &n->left, n, data, key, &existing);
   }
-  BTreeIterator res = {it.tree, up_to_first_right(node->parent)};
+  if (x != NULL)
+    insert_fixup(tree, x);
+  BTreeIterator res = {tree, (x != NULL)? x : existing};
   return res;
 }
 
-bool btree_has_more(BTreeIterator it)
+/* No red-black tree addressable with 64-bit pointers is deeper than this. */
+#define MAX_HEIGHT 128
+
+/*
+ * Makes the subtree at 'n', of black height '*h', a tree of its own: the
+ * parent link is cut and a red root is blackened.
+ */
+static Node* detach(Node *n, int *h)
 {
-  return btree_next(it).node != NULL;
+  if (n == NULL)
+    return NULL;
+  n->parent = NULL;
+  if (n->color == BTREE_RED) {
+    n->color = BTREE_BLACK;
+    *h += 1;
+  }
+  return n;
 }
 
-static void destroy_helper(Node *node)
+/*
+ * Links 'k' between the trees 'l' and 'r', of black heights 'hl' and 'hr',
+ * whose elements all precede and all follow k's. k replaces the first
+ * black node of matching height on the inner spine of the taller tree and
+ * is repaired as a fresh insertion, which costs O(|hl - hr| + 1). The
+ * result is left in the root and black height of 'tree'; its size, first
+ * and last are the caller's to set.
+ */
+static void join_nodes(BTree *tree, Node *l, int hl, Node *k, Node *r, int hr)
 {
-  if (node != NULL) {
-    destroy_helper(node->left);
-    destroy_helper(node->right);
-    free(node);
+  Node *p = NULL;
+  Node *c = NULL;
+  int dir = (hl >= hr);
+  tree->root = dir? l : r;
+  tree->black_height = dir? hl : hr;
+  int h = tree->black_height;
+  c = tree->root;
+  while (h > (dir? hr : hl) || COLOR(c) == BTREE_RED) {
+    h -= (COLOR(c) == BTREE_BLACK);
+    p = c;
+    c = dir? c->right : c->left;
   }
+  k->parent = p;
+  k->left = dir? c : l;
+  k->right = dir? r : c;
+  if (k->left != NULL)
+    k->left->parent = k;
+  if (k->right != NULL)
+    k->right->parent = k;
+  if (p == NULL)
+    tree->root = k;
+  else if (dir)
+    p->right = k;
+  else
+    p->left = k;
+  insert_fixup(tree, k);
 }
 
-void btree_destroy(BTree *tree)
+static bool same_nodes(BTree *a, BTree *b)
+{
+  return a->allocator.alloc == b->allocator.alloc && a->allocator.free == b->allocator.free &&
+      a->allocator.ctx == b->allocator.ctx && a->allocator.release == NULL &&
+      b->allocator.release == NULL && a->key_type == b->key_type && a->augment == b->augment;
+}
+
+bool btree_join(BTree *left, BTree *right)
+{
+  if (left == right || !same_nodes(left, right))
+    return false;
+  if (right->root == NULL)
+    return true;
+  size_t size = left->size + right->size;
+  Node *first = (left->first == NULL)? right->first : left->first;
+  Node *last = right->last;
+  Node *k = unlink_node(right, right->first);
+  join_nodes(left, left->root, left->black_height, k, right->root, right->black_height);
+  left->size = size;
+  left->first = first;
+  left->last = last;
+  right->root = NULL;
+  right->size = 0;
+  right->black_height = 0;
+  right->first = NULL;
+  right->last = NULL;
+  return true;
+}
+
+/*
+ * Standard split along the path from the root to 'at': every subtree hanging
+ * off the path to the left of it is joined into the left tree and every one
+ * to its right into the right tree, with the path nodes as the links.
+ */
+bool btree_split(BTreeIterator at, size_t count, BTree *right)
+{
+  BTree *tree = at.tree;
+  if (tree == right || right->root != NULL || !same_nodes(tree, right))
+    return false;
+  if (at.node == NULL)
+    return true;
+  Node *path[MAX_HEIGHT];
+  int heights[MAX_HEIGHT];
+  int depth = 0;
+  for (Node *n = at.node; n != NULL; n = n->parent)
+    path[depth++] = n;
+  // Black heights of the path nodes, from the root down.
+  int h = tree->black_height;
+  for (int i = depth - 1; i >= 0; --i) {
+    heights[i] = h;
+    h -= (path[i]->color == BTREE_BLACK);
+  }
+  Node *first = tree->first;
+  Node *last = tree->last;
+  Node *before = predecessor(at.node);
+  size_t size = tree->size;
+
+  int hl = heights[0] - (at.node->color == BTREE_BLACK);
+  int hr = hl;
+  Node *l = detach(at.node->left, &hl);
+  Node *r = detach(at.node->right, &hr);
+  join_nodes(right, NULL, 0, at.node, r, hr);
+  tree->root = l;
+  tree->black_height = hl;
+  for (int i = 1; i < depth; ++i) {
+    Node *p = path[i];
+    int hs = heights[i] - (p->color == BTREE_BLACK);
+    if (path[i - 1] == p->left) {
+      Node *s = detach(p->right, &hs);
+      join_nodes(right, right->root, right->black_height, p, s, hs);
+    } else {
+      Node *s = detach(p->left, &hs);
+      join_nodes(tree, s, hs, p, tree->root, tree->black_height);
+    }
+  }
+  right->size = count;
+  right->first = at.node;
+  right->last = last;
+  tree->size = size - count;
+  tree->first = (before == NULL)? NULL : first;
+  tree->last = before;
+  return true;
+}
+
+bool btree_destroy_step(BTree *tree, size_t budget)
 {
-  destroy_helper(tree->root);
+  tree->first = NULL;
+  tree->last = NULL;
+  tree->size = 0;
+  if (tree->allocator.release != NULL) {
+    tree->allocator.release(tree->allocator.ctx);
+    tree->root = NULL;
+  }
+  while (tree->root != NULL && budget > 0) {
+    Node *n = tree->root;
+    if (n->left != NULL) {
+      tree->root = n->left;
+      n->left = tree->root->right;
+      tree->root->right = n;
+    } else {
+      tree->root = n->right;
+      node_free(tree, n);
+    }
+    budget -= 1;
+  }
+  if (tree->root != NULL)
+    return false;
   free(tree);
+  return true;
+}
+
+void btree_destroy(BTree *tree)
+{
+  btree_destroy_step(tree, SIZE_MAX);
+}
+
+struct ReclaimItem {
+  BTree *tree;
+  struct ReclaimItem *next;
+};
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_idle = PTHREAD_COND_INITIALIZER;
+static struct ReclaimItem *reclaim_queue = NULL;
+static bool reclaim_busy = false;
+static bool reclaim_started = false;
+
+static void* reclaimer(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&reclaim_lock);
+  for (;;) {
+    while (reclaim_queue == NULL) {
+      reclaim_busy = false;
+      pthread_cond_broadcast(&reclaim_idle);
+      pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+    }
+    struct ReclaimItem *item = reclaim_queue;
+    reclaim_queue = item->next;
+    reclaim_busy = true;
+    pthread_mutex_unlock(&reclaim_lock);
+    btree_destroy(item->tree);
+    free(item);
+    pthread_mutex_lock(&reclaim_lock);
+  }
+  return NULL;
+}
+
+void btree_destroy_async(BTree *tree)
+{
+  struct ReclaimItem *item = (struct ReclaimItem*)malloc(sizeof(struct ReclaimItem));
+  if (item == NULL) {
+    btree_destroy(tree);
+    return;
+  }
+  item->tree = tree;
+  pthread_mutex_lock(&reclaim_lock);
+  if (!reclaim_started) {
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    reclaim_started = pthread_create(&tid, &attr, reclaimer, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    if (!reclaim_started) {
+      pthread_mutex_unlock(&reclaim_lock);
+      free(item);
+      btree_destroy(tree);
+      return;
+    }
+  }
+  item->next = reclaim_queue;
+  reclaim_queue = item;
+  reclaim_busy = true;
+  pthread_cond_signal(&reclaim_cond);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+void btree_reclaim_wait()
+{
+  pthread_mutex_lock(&reclaim_lock);
+  while (reclaim_busy)
+    pthread_cond_wait(&reclaim_idle, &reclaim_lock);
+  pthread_mutex_unlock(&reclaim_lock);
 }
 
 static int max(int a, int b)
@@ -345,40 +1178,168 @@ int btree_height(BTree *tree)
   return btree_height_helper(tree->root);
 }
 
-static void dump_dot_helper(Node *n, char* (*dot_node_attributes)(Node *n))
+#define DUMP_BUFFER_SIZE (64 * 1024)
+
+/* Room kept free in the dump buffer before a node is formatted into it. */
+#define DUMP_LINE_SIZE 1024
+
+struct DumpFrame {
+  Node *n;
+  int depth;
+};
+
+struct DumpBuffer {
+  BTreeWriter out;
+  size_t len;
+  bool failed;
+  char buf[DUMP_BUFFER_SIZE];
+};
+
+static size_t file_write(void *ctx, const char *buf, size_t len)
+{
+  return fwrite(buf, 1, len, (FILE*)ctx);
+}
+
+BTreeWriter btree_file_writer(FILE *out)
 {
-  if (n == NULL)
-    return;
-  if (n->left != NULL) {
-    printf("\"%p\" -> \"%p\"\n", n, n->left);
+  BTreeWriter res = {file_write, out};
+  return res;
+}
+
+static void dump_flush(DumpBuffer *b)
+{
+  if (b->len > 0 && !b->failed && b->out.write(b->out.ctx, b->buf, b->len) != b->len)
+    b->failed = true;
+  b->len = 0;
+}
+
+static void dump_printf(DumpBuffer *b, const char *format, ...)
+{
+  if (DUMP_BUFFER_SIZE - b->len < DUMP_LINE_SIZE)
+    dump_flush(b);
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(b->buf + b->len, DUMP_BUFFER_SIZE - b->len, format, args);
+  va_end(args);
+  if (len > 0)
+    b->len += ((size_t)len < DUMP_BUFFER_SIZE - b->len)? len : DUMP_BUFFER_SIZE - b->len - 1;
+}
+
+/* Appends format(n) to the buffer, truncated to the free space left. */
+static void dump_format(DumpBuffer *b, Node *n, BTreeFormat format, void *arg)
+{
+  if (DUMP_BUFFER_SIZE - b->len < DUMP_LINE_SIZE)
+    dump_flush(b);
+  int len = format(n, b->buf + b->len, DUMP_BUFFER_SIZE - b->len, arg);
+  if (len > 0)
+    b->len += ((size_t)len < DUMP_BUFFER_SIZE - b->len)? len : DUMP_BUFFER_SIZE - b->len - 1;
+}
+
+static bool dump_finish(DumpBuffer *b)
+{
+  dump_flush(b);
+  bool res = !b->failed;
+  free(b);
+  return res;
+}
+
+static DumpBuffer* dump_start(BTreeWriter out)
+{
+  DumpBuffer *b = (DumpBuffer*)malloc(sizeof(DumpBuffer));
+  if (b == NULL)
+    return NULL;
+  b->out = out;
+  b->len = 0;
+  b->failed = false;
+  return b;
+}
+
+bool btree_dump_dot_to(BTree *tree, BTreeWriter out, BTreeFormat attributes, void *arg,
+                       int max_depth, size_t max_nodes)
+{
+  DumpBuffer *b = dump_start(out);
+  if (b == NULL)
+    return false;
+  DumpFrame stack[2 * MAX_HEIGHT];
+  int top = 0;
+  if (tree->root != NULL && max_depth != 0) {
+    stack[top].n = tree->root;
+    stack[top++].depth = 0;
+  }
+  dump_printf(b, "digraph {\n");
+  for (size_t count = 0; top > 0 && (max_nodes == 0 || count < max_nodes); ++count) {
+    Node *n = stack[--top].n;
+    int depth = stack[top].depth;
+    if (n->parent != NULL)
+      dump_printf(b, "\"%p\" -> \"%p\"\n", (void*)n->parent, (void*)n);
+    dump_printf(b, "\"%p\" ", (void*)n);
+    dump_format(b, n, attributes, arg);
+    dump_printf(b, "\n");
+    if (max_depth >= 0 && depth >= max_depth)
+      continue;
+    Node *children[2] = {n->right, n->left};
+    for (int i = 0; i < 2; ++i) {
+      if (children[i] != NULL) {
+        stack[top].n = children[i];
+        stack[top++].depth = depth + 1;
+      }
+    }
   }
-  if (n->right != NULL) {
-    printf("\"%p\" -> \"%p\"\n", n, n->right);
+  dump_printf(b, "}\n");
+  return dump_finish(b);
+}
+
+bool btree_dump_to(BTree *tree, BTreeWriter out, BTreeFormat format, void *arg,
+                   int max_depth, size_t max_nodes)
+{
+  DumpBuffer *b = dump_start(out);
+  if (b == NULL)
+    return false;
+  DumpFrame stack[MAX_HEIGHT];
+  int top = 0;
+  Node *n = tree->root;
+  int depth = 0;
+  size_t count = 0;
+  for (;;) {
+    while (n != NULL && (max_depth < 0 || depth <= max_depth)) {
+      stack[top].n = n;
+      stack[top++].depth = depth;
+      n = n->right;
+      depth += 1;
+    }
+    dump_printf(b, "%*s", 4 * depth, "");
+    if (n == NULL)
+      dump_format(b, NULL, format, arg);
+    else
+      dump_printf(b, "...");
+    dump_printf(b, "\n");
+    if (top == 0 || (max_nodes != 0 && count == max_nodes))
+      break;
+    n = stack[--top].n;
+    depth = stack[top].depth;
+    dump_printf(b, "%*s", 4 * depth, "");
+    dump_format(b, n, format, arg);
+    dump_printf(b, "\n");
+    count += 1;
+    n = n->left;
+    depth += 1;
   }
-  printf("\"%p\" %s\n", n, dot_node_attributes(n));
-  dump_dot_helper(n->left, dot_node_attributes);
-  dump_dot_helper(n->right, dot_node_attributes);
+  return dump_finish(b);
 }
 
-void btree_dump_dot(BTree *tree, char* (*dot_node_attributes)(Node *n))
+/* Adapts the callbacks of btree_dump and btree_dump_dot to BTreeFormat. */
+static int format_string(Node *n, char *buf, size_t size, void *arg)
 {
-  printf("digraph {\n");
-  dump_dot_helper(tree->root, dot_node_attributes);
-  printf("}");
+  char* (*to_string)(Node *n) = *(char* (**)(Node *))arg;
+  return snprintf(buf, size, "%s", to_string(n));
 }
 
-void dump_helper(Node *n, int indent, char* (*dump_node)(Node *n))
+void btree_dump_dot(BTree *tree, char* (*dot_node_attributes)(Node *n))
 {
-  if (n != NULL)
-    dump_helper(n->right, indent + 4, dump_node);
-  for (int i = 0; i < indent; ++i)
-    putchar(' ');
-  printf("%s\n", dump_node(n));
-  if (n != NULL)
-    dump_helper(n->left, indent + 4, dump_node);
+  btree_dump_dot_to(tree, btree_file_writer(stdout), format_string, &dot_node_attributes, -1, 0);
 }
 
 void btree_dump(BTree *tree, char* (*dump_node)(Node *n))
 {
-  dump_helper(tree->root, 0, dump_node);
-}
\ No newline at end of file
+  btree_dump_to(tree, btree_file_writer(stdout), format_string, &dump_node, -1, 0);
+}
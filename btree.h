@@ -3,31 +3,111 @@
 #define BTREE
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "stdlib.h"
 
+/* Alignment used to keep per-thread state on separate cache lines. */
+#define BTREE_CACHE_LINE 64
+
 enum NodeColor {BTREE_RED, BTREE_BLACK};
 
+/**
+  * How a tree orders its elements. BTREE_KEY_POINTER calls the tree's compare
+  * function on the inserted pointers; the integer and double types copy a
+  * fixed-width key into each node and compare it inline. BTREE_KEY_PREFIX
+  * caches an 8-byte prefix of each element and calls the compare function
+  * only when the prefixes are equal.
+  **/
+enum BTreeKeyType {BTREE_KEY_POINTER, BTREE_KEY_INT64, BTREE_KEY_UINT64, BTREE_KEY_DOUBLE,
+  BTREE_KEY_PREFIX};
+
+union BTreeKey {
+  int64_t i64;
+  uint64_t u64;
+  double f64;
+};
+
 struct Node {
   struct Node *left;
   struct Node *right;
   struct Node *parent;
   void *data;
+  BTreeKey key;
   NodeColor color;
+  uint32_t hits;  // sampled accesses, see btree_heat_enable
 };
 
+typedef struct Node Node;
+
+/**
+  * Node allocation callbacks. NULL 'alloc' and 'free' fall back to malloc
+  * and free. If 'release' is set, destroying the tree calls it once to drop
+  * every node at the same time instead of freeing them one by one.
+  * 'footprint', if set, returns the bytes the allocator currently holds and
+  * is used by btree_memory_usage; it must be constant time.
+  **/
+struct BTreeAllocator {
+  void* (*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void (*release)(void *ctx);
+  void *ctx;
+  size_t (*footprint)(void *ctx);
+};
+
+typedef struct BTreeAllocator BTreeAllocator;
+
 struct BTree {
   struct Node *root;
+  size_t size;
+  int black_height;
+  BTreeAllocator allocator;
   int (*cmp)(void *, void *);
+  BTreeKeyType key_type;
+  uint64_t (*prefix)(void *);
+  void (*augment)(Node *);
+  struct Node *first;
+  struct Node *last;
+  unsigned heat_sample;
+  unsigned heat_ticks;
 };
 
+/**
+  * Memory held by a tree. 'overhead_bytes' covers allocator headers and
+  * unused allocator space as well as the tree header itself.
+  **/
+struct BTreeMemory {
+  size_t node_bytes;
+  size_t overhead_bytes;
+  double bytes_per_element;
+};
+
+typedef struct BTreeMemory BTreeMemory;
+
+/**
+  * Destination of the streaming dumps. 'write' must consume 'len' bytes of
+  * 'buf' and return the number written; anything less is an error.
+  **/
+struct BTreeWriter {
+  size_t (*write)(void *ctx, const char *buf, size_t len);
+  void *ctx;
+};
+
+typedef struct BTreeWriter BTreeWriter;
+
+/**
+  * Formats node 'n' (NULL for a leaf) into 'buf' of 'size' bytes and returns
+  * the length as snprintf does; longer output is truncated.
+  **/
+typedef int (*BTreeFormat)(Node *n, char *buf, size_t size, void *arg);
+
 struct BTreeIterator {
   struct BTree *tree;  
   struct Node *node;
 };
 
 typedef struct BTree BTree;
-typedef struct Node Node;
 
 /** 
   * Creates a new tree, using 'cmp' as a compare function.
@@ -36,32 +116,218 @@ typedef struct Node Node;
   **/
 BTree* btree_create(int (*cmp) (void *, void *));
 
+/**
+  * Creates a tree keyed by 64-bit integers or doubles stored inline in the
+  * nodes, so lookups neither call a compare function nor dereference 'data'.
+  * Every pointer passed to the tree must point to the key (e.g. to the first
+  * member of the client's record); the key is copied on insertion. NaN keys
+  * are not supported. Returns NULL unless 'key_type' is BTREE_KEY_INT64,
+  * BTREE_KEY_UINT64 or BTREE_KEY_DOUBLE.
+  **/
+BTree* btree_create_keyed(BTreeKeyType key_type);
+
+/**
+  * Creates a tree that stores prefix(data) in each node and compares those
+  * first, falling back to 'cmp' on a tie. The prefix must be order-preserving:
+  * prefix(a) < prefix(b) must imply cmp(a, b) < 0.
+  **/
+BTree* btree_create_prefixed(int (*cmp) (void *, void *), uint64_t (*prefix) (void *));
+
+/**
+  * Prefix function for NUL-terminated strings ordered by strcmp: the first
+  * eight bytes packed big-endian, zero-padded.
+  **/
+uint64_t btree_string_prefix(void *data);
+
+/**
+  * Creates a tree whose nodes carry a value derived from their subtrees.
+  * 'augment' is called on a node whenever its children change and must
+  * recompute the node's derived value from the node and its children.
+  **/
+BTree* btree_create_augmented(int (*cmp) (void *, void *), void (*augment) (Node *));
+
+/**
+  * Makes the tree take its nodes from 'allocator'. Must be called while the
+  * tree is empty.
+  **/
+void btree_set_allocator(BTree *tree, BTreeAllocator allocator);
+
+/**
+  * Takes an uninitialized node from the tree's allocator, for code that links
+  * nodes itself (see btree_build_parallel). Linked nodes are freed with the
+  * tree. Returns NULL if memory runs out.
+  **/
+Node* btree_node_alloc(BTree *tree);
+
+/**
+  * Compares 'data' with the element stored in 'node' the way the tree does,
+  * including inline and prefix keys.
+  **/
+int btree_compare(BTree *tree, void *data, Node *node);
+
 bool btree_isempty(BTree *tree);
 
+size_t btree_size(BTree *tree);
+
+/**
+  * Returns the number of black nodes on every path from the root to a leaf,
+  * maintained by insert and remove. The height lies between it and twice it.
+  **/
+int btree_black_height(BTree *tree);
+
+/**
+  * Reports the memory held by the tree in constant time. Without a
+  * 'footprint' callback the allocator overhead is estimated from malloc's
+  * per-chunk header and rounding.
+  **/
+BTreeMemory btree_memory_usage(BTree *tree);
+
 /**
   * Inserts a pointer 'data' into the tree. The client is responsible
   * not to modify inserted objects so that tree's structure will be preserved
   **/
 bool btree_insert(BTree *tree, void *data);
 
+/**
+  * Inserts 'data' searching from 'hint' instead of from the root: the search
+  * climbs from the hint only as far as needed and descends from there. When
+  * 'hint' is the element preceding 'data' (e.g. the previously inserted one
+  * in an ascending stream) this costs amortized O(1) plus rebalancing.
+  * A past-the-end hint means the last element. Returns an iterator to the
+  * inserted (or already present) element, with a NULL node if out of memory.
+  **/
+BTreeIterator btree_insert_hint(BTree *tree, BTreeIterator hint, void *data);
+
 BTreeIterator btree_find(BTree *tree, void *data);
 
+/**
+  * Returns an iterator to the smallest element not less than 'data', with a
+  * NULL node if there is none.
+  **/
+BTreeIterator btree_lower_bound(BTree *tree, void *data);
+
 bool btree_member(BTree *tree, void *data);
 
 void btree_remove(BTreeIterator it);
 
+/**
+  * Single-pass variants of btree_insert and removal by value. Color flips
+  * and rotations are done on the way down, so no ancestor of the current
+  * node's parent is touched again. btree_remove_topdown returns false if no element equals 'data'.
+  **/
+bool btree_insert_topdown(BTree *tree, void *data);
+
+bool btree_remove_topdown(BTree *tree, void *data);
+
+/**
+  * Moves every element of 'right' to the end of 'left' in O(log n) time and
+  * without allocating; each element of 'left' must be less than each element
+  * of 'right', which is left empty. Returns false and changes nothing if the
+  * trees differ in allocator, key type or augmentation, or use an allocator
+  * with a 'release' callback, which cannot be split between trees.
+  **/
+bool btree_join(BTree *left, BTree *right);
+
+/**
+  * Moves the element at 'at' and every later one into the empty tree 'right'
+  * in O(log n) time and without allocating. The tree keeps no subtree sizes,
+  * so 'count' must be the number of moved elements, e.g. counted by the
+  * caller on its way to 'at'. A past-the-end 'at' moves nothing. Returns
+  * false and changes nothing under the conditions of btree_join.
+  **/
+bool btree_split(BTreeIterator at, size_t count, BTree *right);
+
 BTreeIterator btree_begin(BTree *tree);
 
+/**
+  * Smallest and largest elements of the tree, or NULL if it is empty.
+  * Both are cached in the tree and returned in constant time.
+  **/
+void* btree_first(BTree *tree);
+
+void* btree_last(BTree *tree);
+
+/**
+  * Removes the smallest (largest) element and returns it, or returns NULL
+  * if the tree is empty. Apart from the rebalancing this takes amortized
+  * constant time, which makes the tree usable as a priority queue.
+  **/
+void* btree_pop_first(BTree *tree);
+
+void* btree_pop_last(BTree *tree);
+
 BTreeIterator btree_next(BTreeIterator it);
 
 bool btree_has_more(BTreeIterator it);
 
+/**
+  * Reverse iteration: btree_rbegin returns an iterator to the largest
+  * element and btree_prev steps to the preceding one, so the k largest
+  * elements cost O(k) and k elements before a btree_lower_bound result
+  * O(log n + k). btree_end is the past-the-end iterator (a NULL node), from
+  * which btree_prev also reaches the largest element. btree_has_prev tells
+  * whether btree_prev would return an element.
+  **/
+BTreeIterator btree_rbegin(BTree *tree);
+
+BTreeIterator btree_end(BTree *tree);
+
+BTreeIterator btree_prev(BTreeIterator it);
+
+bool btree_has_prev(BTreeIterator it);
+
 void btree_destroy(BTree *tree);
 
+/**
+  * Does at most 'budget' steps of destroying the tree, each of which either
+  * frees a node or rotates one out of the way, and returns true once the
+  * whole tree, including the BTree itself, is gone. Teardown runs in
+  * constant space, so a large tree can be dropped a slice at a time, e.g.
+  * once per event-loop iteration. After the first call the tree must not be
+  * used for anything but further btree_destroy_step calls.
+  **/
+bool btree_destroy_step(BTree *tree, size_t budget);
+
+/**
+  * Hands the tree to a background reclaimer thread, started on first use,
+  * and returns immediately. Custom allocators must accept frees from that
+  * thread.
+  **/
+void btree_destroy_async(BTree *tree);
+
+/**
+  * Blocks until the reclaimer has freed every tree handed to it so far.
+  **/
+void btree_reclaim_wait();
+
+/**
+  * Returns the exact height by visiting every node; see btree_black_height
+  * for a constant-time bound.
+  **/
 int btree_height(BTree *tree);
 
 void btree_dump(BTree *tree, char* (*dump_node)(Node *n));
 
 void btree_dump_dot(BTree *tree, char* (*dot_node_attributes)(Node *));
 
+BTreeWriter btree_file_writer(FILE *out);
+
+/**
+  * Writes the tree sideways, one node per line indented by depth with the
+  * right subtree first, through a 64 KiB buffer and without recursion.
+  * Levels below 'max_depth' (the root is level 0; negative for no limit)
+  * are elided as "...", and the dump stops after 'max_nodes' nodes (0 for
+  * no limit). Returns false if the writer failed or memory ran out.
+  **/
+bool btree_dump_to(BTree *tree, BTreeWriter out, BTreeFormat format, void *arg,
+                   int max_depth, size_t max_nodes);
+
+/**
+  * Writes the tree as a graphviz digraph in preorder, with 'attributes'
+  * giving each node's attribute list. Limits and result as btree_dump_to;
+  * only the edges between written nodes are included.
+  **/
+bool btree_dump_dot_to(BTree *tree, BTreeWriter out, BTreeFormat attributes, void *arg,
+                       int max_depth, size_t max_nodes);
+
 #endif  // BTREE
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "btree_arena.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+static bool map_chunk(BTreeArena *arena)
+{
+  size_t size = arena->chunk_size;
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (arena->flags & BTREE_ARENA_HUGETLB)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return false;
+#ifdef MADV_HUGEPAGE
+    if (arena->flags & BTREE_ARENA_THP)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  BTreeArenaChunk *chunk = (BTreeArenaChunk*)p;
+  chunk->next = arena->chunks;
+  chunk->size = size;
+  arena->chunks = chunk;
+  arena->cur = (char*)p + ALIGN_UP(sizeof(BTreeArenaChunk), 16);
+  arena->end = (char*)p + size;
+  arena->mapped += size;
+  return true;
+}
+
+static void* arena_alloc(void *ctx, size_t size)
+{
+  BTreeArena *arena = (BTreeArena*)ctx;
+  if (arena->free_nodes != NULL) {
+    void *p = arena->free_nodes;
+    arena->free_nodes = *(void**)p;
+    return p;
+  }
+  size = ALIGN_UP(size, sizeof(void*));
+  // A fresh chunk could not hold it either.
+  if (size > arena->chunk_size - ALIGN_UP(sizeof(BTreeArenaChunk), 16))
+    return NULL;
+  if (arena->cur + size > arena->end && !map_chunk(arena))
+    return NULL;
+  void *p = arena->cur;
+  arena->cur += size;
+  return p;
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+  BTreeArena *arena = (BTreeArena*)ctx;
+  *(void**)ptr = arena->free_nodes;
+  arena->free_nodes = ptr;
+}
+
+static void arena_release(void *ctx)
+{
+  BTreeArena *arena = (BTreeArena*)ctx;
+  while (arena->chunks != NULL) {
+    BTreeArenaChunk *chunk = arena->chunks;
+    arena->chunks = chunk->next;
+    munmap(chunk, chunk->size);
+  }
+  free(arena);
+}
+
+static size_t arena_footprint(void *ctx)
+{
+  return ((BTreeArena*)ctx)->mapped + sizeof(BTreeArena);
+}
+
+bool btree_use_arena(BTree *tree, size_t chunk_size, int flags)
+{
+  BTreeArena *arena = (BTreeArena*)malloc(sizeof(BTreeArena));
+  if (arena == NULL)
+    return false;
+  size_t page = (flags & BTREE_ARENA_HUGETLB)? BTREE_ARENA_CHUNK : 4096;
+  arena->chunk_size = ALIGN_UP((chunk_size == 0)? BTREE_ARENA_CHUNK : chunk_size, page);
+  arena->flags = flags;
+  arena->chunks = NULL;
+  arena->free_nodes = NULL;
+  arena->mapped = 0;
+  if (!map_chunk(arena)) {
+    free(arena);
+    return false;
+  }
+  BTreeAllocator allocator = {arena_alloc, arena_free, arena_release, arena, arena_footprint};
+  btree_set_allocator(tree, allocator);
+  return true;
+}
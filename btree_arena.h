@@ -0,0 +1,47 @@
+#ifndef BTREE_ARENA
+#define BTREE_ARENA
+
+#include "btree.h"
+
+/* Default chunk size: one 2 MiB huge page on x86-64. */
+#define BTREE_ARENA_CHUNK (2 * 1024 * 1024)
+
+enum BTreeArenaFlags {
+  BTREE_ARENA_HUGETLB = 1,  // map chunks with MAP_HUGETLB, falling back to normal pages
+  BTREE_ARENA_THP = 2       // ask for transparent huge pages with madvise
+};
+
+/**
+  * Chunk header; nodes are carved from the rest of the chunk.
+  **/
+struct BTreeArenaChunk {
+  struct BTreeArenaChunk *next;
+  size_t size;
+};
+
+/**
+  * Bump-pointer node arena. Freed nodes go to 'free_nodes' and are reused;
+  * memory is only returned when the whole arena is unmapped.
+  **/
+struct BTreeArena {
+  struct BTreeArenaChunk *chunks;
+  char *cur;
+  char *end;
+  size_t chunk_size;
+  int flags;
+  void *free_nodes;
+  size_t mapped;
+};
+
+typedef struct BTreeArenaChunk BTreeArenaChunk;
+typedef struct BTreeArena BTreeArena;
+
+/**
+  * Makes the empty tree 'tree' carve its nodes from an mmap-backed arena of
+  * 'chunk_size'-byte chunks (0 for BTREE_ARENA_CHUNK), mapped according to
+  * 'flags'. btree_destroy then unmaps the chunks instead of visiting every
+  * node. Returns false if the first chunk cannot be mapped.
+  **/
+bool btree_use_arena(BTree *tree, size_t chunk_size, int flags);
+
+#endif  // BTREE_ARENA
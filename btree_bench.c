@@ -0,0 +1,557 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <malloc.h>
+
+#include "btree.h"
+#include "btree_sharded.h"
+#include "btree_fc.h"
+#include "btree_parallel.h"
+#include "btree_arena.h"
+#include "btree_compact.h"
+#include "btree_stats.h"
+#include "btree_lean.h"
+#include "btree_hoh.h"
+
+int int_compare (void *va, void *vb)
+{
+  int *a = (int*)va;
+  int *b = (int*)vb;
+  return (*a > *b) - (*a < *b);
+}
+
+int int64_compare (void *va, void *vb)
+{
+  int64_t *a = (int64_t*)va;
+  int64_t *b = (int64_t*)vb;
+  return (*a > *b) - (*a < *b);
+}
+
+int str_compare (void *va, void *vb)
+{
+  return strcmp((char*)va, (char*)vb);
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, int n, double sec)
+{
+  printf("%-32s %10d ops %8.3f s %12.0f ops/s\n", name, n, sec, n / sec);
+}
+
+static void bench_ascending_ingest(int n)
+{
+  int *a = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    a[i] = i;
+
+  BTree *tree = btree_create(int_compare);
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&a[i]);
+  report("ascending btree_insert", n, now_sec() - start);
+  btree_destroy(tree);
+
+  tree = btree_create(int_compare);
+  start = now_sec();
+  BTreeIterator hint = btree_begin(tree);
+  for (int i = 0; i < n; ++i)
+    hint = btree_insert_hint(tree, hint, (void*)&a[i]);
+  report("ascending btree_insert_hint", n, now_sec() - start);
+  btree_destroy(tree);
+
+  for (int i = 0; i < n; ++i)
+    a[i] = i + rand() % 16;
+  tree = btree_create(int_compare);
+  start = now_sec();
+  hint = btree_begin(tree);
+  for (int i = 0; i < n; ++i)
+    hint = btree_insert_hint(tree, hint, (void*)&a[i]);
+  report("nearly sorted btree_insert_hint", n, now_sec() - start);
+  btree_destroy(tree);
+  free(a);
+}
+
+static void bench_lookup(BTree *tree, const char *name, int64_t *keys, int n)
+{
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&keys[i]);
+  const int lookups = 4 * n;
+  int found = 0;
+  double start = now_sec();
+  for (int i = 0; i < lookups; ++i) {
+    int64_t key = keys[(i * 7919LL) % n];
+    found += btree_member(tree, (void*)&key);
+  }
+  report(name, lookups, now_sec() - start);
+  if (found != lookups)
+    printf("lookup benchmark lost %d keys\n", lookups - found);
+  btree_destroy(tree);
+}
+
+static void bench_int64_keys(int n)
+{
+  int64_t *keys = (int64_t*)malloc(sizeof(int64_t) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = ((int64_t)rand() << 31 | rand()) * n + i;
+  bench_lookup(btree_create(int64_compare), "int64 lookups, compare function", keys, n);
+  bench_lookup(btree_create_keyed(BTREE_KEY_INT64), "int64 lookups, inline keys", keys, n);
+  free(keys);
+}
+
+static void bench_string_lookup(BTree *tree, const char *name, char **keys, int n)
+{
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)keys[i]);
+  const int lookups = 4 * n;
+  int found = 0;
+  double start = now_sec();
+  for (int i = 0; i < lookups; ++i)
+    found += btree_member(tree, (void*)keys[(i * 7919LL) % n]);
+  report(name, lookups, now_sec() - start);
+  if (found != lookups)
+    printf("lookup benchmark lost %d keys\n", lookups - found);
+  btree_destroy(tree);
+}
+
+static void bench_string_keys(int n)
+{
+  char **keys = (char**)malloc(sizeof(char*) * n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = (char*)malloc(64);
+    snprintf(keys[i], 64, "/u/%08x/profile/%d", rand(), i);
+  }
+  bench_string_lookup(btree_create(str_compare), "string lookups, compare function", keys, n);
+  bench_string_lookup(btree_create_prefixed(str_compare, btree_string_prefix),
+      "string lookups, cached prefixes", keys, n);
+  for (int i = 0; i < n; ++i)
+    free(keys[i]);
+  free(keys);
+}
+
+struct InsertJob {
+  void *container;
+  bool (*insert)(void *container, void *data);
+  int *keys;
+  int n;
+};
+
+static void* insert_worker(void *arg)
+{
+  InsertJob *job = (InsertJob*)arg;
+  for (int i = 0; i < job->n; ++i)
+    job->insert(job->container, (void*)&job->keys[i]);
+  return NULL;
+}
+
+/* Splits 'keys' evenly across 'threads' workers and returns the wall time. */
+static double run_insert_threads(void *container, bool (*insert)(void *, void *),
+    int *keys, int n, int threads)
+{
+  pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+  InsertJob *jobs = (InsertJob*)malloc(sizeof(InsertJob) * threads);
+  double start = now_sec();
+  for (int t = 0; t < threads; ++t) {
+    jobs[t].container = container;
+    jobs[t].insert = insert;
+    jobs[t].keys = keys + (long)n * t / threads;
+    jobs[t].n = (long)n * (t + 1) / threads - (long)n * t / threads;
+    pthread_create(&tids[t], NULL, insert_worker, &jobs[t]);
+  }
+  for (int t = 0; t < threads; ++t)
+    pthread_join(tids[t], NULL);
+  double sec = now_sec() - start;
+  free(jobs);
+  free(tids);
+  return sec;
+}
+
+struct LockedTree {
+  BTree *tree;
+  pthread_mutex_t lock;
+};
+
+static bool locked_insert(void *container, void *data)
+{
+  LockedTree *lt = (LockedTree*)container;
+  pthread_mutex_lock(&lt->lock);
+  bool res = btree_insert(lt->tree, data);
+  pthread_mutex_unlock(&lt->lock);
+  return res;
+}
+
+static bool sharded_insert(void *container, void *data)
+{
+  return btree_sharded_insert((BTreeSharded*)container, data);
+}
+
+static void bench_sharded_insert(int n)
+{
+  const int nshards = 64;
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+  int split[nshards - 1];
+  void *bounds[nshards - 1];
+  for (int i = 0; i < nshards - 1; ++i) {
+    split[i] = (int)((long)RAND_MAX * (i + 1) / nshards);
+    bounds[i] = &split[i];
+  }
+  char name[64];
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    LockedTree lt = {btree_create(int_compare), PTHREAD_MUTEX_INITIALIZER};
+    snprintf(name, sizeof(name), "global mutex, %d threads", threads);
+    report(name, n, run_insert_threads(&lt, locked_insert, keys, n, threads));
+    btree_destroy(lt.tree);
+
+    BTreeSharded *st = btree_sharded_create(int_compare, nshards, bounds);
+    snprintf(name, sizeof(name), "%d shards, %d threads", nshards, threads);
+    report(name, n, run_insert_threads(st, sharded_insert, keys, n, threads));
+    btree_sharded_destroy(st);
+  }
+  free(keys);
+}
+
+static bool locked_remove(void *container, void *data)
+{
+  LockedTree *lt = (LockedTree*)container;
+  pthread_mutex_lock(&lt->lock);
+  BTreeIterator it = btree_find(lt->tree, data);
+  bool res = (it.node != NULL);
+  if (res)
+    btree_remove(it);
+  pthread_mutex_unlock(&lt->lock);
+  return res;
+}
+
+static bool hoh_insert(void *container, void *data)
+{
+  return btree_hoh_insert((BTreeHoh*)container, data);
+}
+
+static bool hoh_remove(void *container, void *data)
+{
+  return btree_hoh_remove((BTreeHoh*)container, data);
+}
+
+/*
+ * Inserts and then removes all keys, one global mutex against hand-over-hand
+ * locking. Each thread takes a contiguous slice of 'keys': with sorted keys
+ * the threads write disjoint key ranges, with shuffled ones all over the tree.
+ */
+static void bench_contention(int n)
+{
+  int *sorted = (int*)malloc(sizeof(int) * n);
+  int *shuffled = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i) {
+    sorted[i] = i;
+    int j = rand() % (i + 1);
+    shuffled[i] = shuffled[j];
+    shuffled[j] = i;
+  }
+  char name[64];
+  for (int pass = 0; pass < 2; ++pass) {
+    const char *pattern = (pass == 0)? "disjoint" : "overlapping";
+    int *keys = (pass == 0)? sorted : shuffled;
+    for (int threads = 1; threads <= 64; threads *= 2) {
+      LockedTree lt = {btree_create(int_compare), PTHREAD_MUTEX_INITIALIZER};
+      double sec = run_insert_threads(&lt, locked_insert, keys, n, threads);
+      sec += run_insert_threads(&lt, locked_remove, keys, n, threads);
+      snprintf(name, sizeof(name), "global mutex, %s, %d threads", pattern, threads);
+      report(name, 2 * n, sec);
+      btree_destroy(lt.tree);
+
+      BTreeHoh *hoh = btree_hoh_create(int_compare);
+      sec = run_insert_threads(hoh, hoh_insert, keys, n, threads);
+      sec += run_insert_threads(hoh, hoh_remove, keys, n, threads);
+      snprintf(name, sizeof(name), "hand-over-hand, %s, %d threads", pattern, threads);
+      report(name, 2 * n, sec);
+      btree_hoh_destroy(hoh);
+    }
+  }
+  free(sorted);
+  free(shuffled);
+}
+
+static __thread int fc_slot = -1;
+
+static bool fc_insert(void *container, void *data)
+{
+  BTreeFC *fc = (BTreeFC*)container;
+  if (fc_slot == -1)
+    fc_slot = btree_fc_register(fc);
+  return btree_fc_insert(fc, fc_slot, data);
+}
+
+static void bench_flat_combining(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+  char name[64];
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    LockedTree lt = {btree_create(int_compare), PTHREAD_MUTEX_INITIALIZER};
+    snprintf(name, sizeof(name), "global mutex, %d threads", threads);
+    report(name, n, run_insert_threads(&lt, locked_insert, keys, n, threads));
+    btree_destroy(lt.tree);
+
+    BTreeFC *fc = btree_fc_create(btree_create(int_compare), threads);
+    snprintf(name, sizeof(name), "flat combining, %d threads", threads);
+    report(name, n, run_insert_threads(fc, fc_insert, keys, n, threads));
+    btree_fc_destroy(fc);
+  }
+  free(keys);
+}
+
+static void bench_build(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  void **items = (void**)malloc(sizeof(void*) * n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = rand();
+    items[i] = &keys[i];
+  }
+  BTree *tree = btree_create(int_compare);
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, items[i]);
+  report("sequential btree_insert", n, now_sec() - start);
+  btree_destroy(tree);
+  char name[64];
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    start = now_sec();
+    tree = btree_build_parallel(int_compare, items, n, threads);
+    snprintf(name, sizeof(name), "btree_build_parallel, %d threads", threads);
+    report(name, n, now_sec() - start);
+    btree_destroy(tree);
+  }
+  free(items);
+  free(keys);
+}
+
+/* Bottom-up against top-down insert and remove of the same random keys. */
+static void bench_topdown(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+
+  BTree *tree = btree_create(int_compare);
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&keys[i]);
+  report("bottom-up insert", n, now_sec() - start);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_remove(btree_find(tree, (void*)&keys[i]));
+  report("bottom-up find + remove", n, now_sec() - start);
+  btree_destroy(tree);
+
+  tree = btree_create(int_compare);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert_topdown(tree, (void*)&keys[i]);
+  report("top-down insert", n, now_sec() - start);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_remove_topdown(tree, (void*)&keys[i]);
+  report("top-down remove", n, now_sec() - start);
+  btree_destroy(tree);
+  free(keys);
+}
+
+static void sum_element(void *data, void *arg)
+{
+  __atomic_add_fetch((long long*)arg, *(int*)data, __ATOMIC_RELAXED);
+}
+
+static void bench_foreach(int n)
+{
+  BTree *tree = btree_create(int_compare);
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = rand();
+    btree_insert(tree, (void*)&keys[i]);
+  }
+  long long sum = 0;
+  double start = now_sec();
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it))
+    sum += *(int*)it.node->data;
+  report("btree_next walk", (int)btree_size(tree), now_sec() - start);
+  char name[64];
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    sum = 0;
+    start = now_sec();
+    btree_parallel_foreach(tree, sum_element, &sum, threads);
+    snprintf(name, sizeof(name), "btree_parallel_foreach, %d threads", threads);
+    report(name, (int)btree_size(tree), now_sec() - start);
+  }
+  btree_destroy(tree);
+  free(keys);
+}
+
+static void bench_arena_tree(BTree *tree, const char *name, int64_t *keys, int n)
+{
+  char label[64];
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&keys[i]);
+  snprintf(label, sizeof(label), "%s: insert", name);
+  report(label, n, now_sec() - start);
+  int found = 0;
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    found += btree_member(tree, (void*)&keys[(i * 7919LL) % n]);
+  snprintf(label, sizeof(label), "%s: lookup", name);
+  report(label, found, now_sec() - start);
+  start = now_sec();
+  btree_destroy(tree);
+  snprintf(label, sizeof(label), "%s: destroy", name);
+  report(label, n, now_sec() - start);
+}
+
+static void bench_arena(int n)
+{
+  int64_t *keys = (int64_t*)malloc(sizeof(int64_t) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = ((int64_t)rand() << 31 | rand()) * n + i;
+  bench_arena_tree(btree_create_keyed(BTREE_KEY_INT64), "malloc", keys, n);
+  BTree *tree = btree_create_keyed(BTREE_KEY_INT64);
+  btree_use_arena(tree, 0, BTREE_ARENA_THP);
+  bench_arena_tree(tree, "arena+THP", keys, n);
+  tree = btree_create_keyed(BTREE_KEY_INT64);
+  btree_use_arena(tree, 0, BTREE_ARENA_HUGETLB);
+  bench_arena_tree(tree, "arena+hugetlb", keys, n);
+  free(keys);
+}
+
+static size_t heap_in_use()
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static void bench_compact(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+
+  size_t heap = heap_in_use();
+  BTree *tree = btree_create(int_compare);
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&keys[i]);
+  report("pointer nodes: insert", n, now_sec() - start);
+  printf("pointer nodes: %.1f bytes per element\n", (double)(heap_in_use() - heap) / btree_size(tree));
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_member(tree, (void*)&keys[(i * 7919LL) % n]);
+  report("pointer nodes: lookup", n, now_sec() - start);
+  btree_destroy(tree);
+
+  heap = heap_in_use();
+  BTreeCompact *compact = btree_compact_create(int_compare);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_compact_insert(compact, (void*)&keys[i]);
+  report("32-bit index nodes: insert", n, now_sec() - start);
+  printf("32-bit index nodes: %.1f bytes per element\n", (double)(heap_in_use() - heap) / compact->size);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_compact_member(compact, (void*)&keys[(i * 7919LL) % n]);
+  report("32-bit index nodes: lookup", n, now_sec() - start);
+  btree_compact_destroy(compact);
+  free(keys);
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)(int n);
+};
+
+/* Random inserts, lookups and a full scan without parent pointers. */
+static void bench_lean(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+
+  size_t heap = heap_in_use();
+  BTreeLean *tree = btree_lean_create(int_compare);
+  double start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_lean_insert(tree, (void*)&keys[i]);
+  report("lean nodes: insert", n, now_sec() - start);
+  printf("lean nodes: %.1f bytes per element\n", (double)(heap_in_use() - heap) / tree->size);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_lean_member(tree, (void*)&keys[(i * 7919LL) % n]);
+  report("lean nodes: lookup", n, now_sec() - start);
+  BTreeLeanCursor cursor;
+  size_t count = 0;
+  start = now_sec();
+  for (void *d = btree_lean_first(tree, &cursor); d != NULL; d = btree_lean_next(&cursor))
+    ++count;
+  report("lean nodes: scan", (int)count, now_sec() - start);
+  start = now_sec();
+  for (int i = 0; i < n; ++i)
+    btree_lean_remove(tree, (void*)&keys[i]);
+  report("lean nodes: remove", n, now_sec() - start);
+  btree_lean_destroy(tree);
+  free(keys);
+}
+
+/* Tail latencies of random inserts, lookups and removes, one in 16 sampled. */
+static void bench_latency(int n)
+{
+  int *keys = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    keys[i] = rand();
+
+  BTreeStats *st = btree_stats_create(btree_create(int_compare), 16);
+  for (int i = 0; i < n; ++i)
+    btree_stats_insert(st, (void*)&keys[i]);
+  for (int i = 0; i < n; ++i)
+    btree_stats_find(st, (void*)&keys[(i * 7919LL) % n]);
+  for (int i = 0; i < n; ++i)
+    btree_stats_remove(st, btree_find(st->tree, (void*)&keys[i]));
+  btree_stats_dump(st, stdout);
+  btree_stats_destroy(st);
+  free(keys);
+}
+
+static const Benchmark benchmarks[] = {
+  {"ascending", bench_ascending_ingest},
+  {"int64", bench_int64_keys},
+  {"string", bench_string_keys},
+  {"sharded", bench_sharded_insert},
+  {"fc", bench_flat_combining},
+  {"build", bench_build},
+  {"foreach", bench_foreach},
+  {"arena", bench_arena},
+  {"compact", bench_compact},
+  {"latency", bench_latency},
+  {"lean", bench_lean},
+  {"topdown", bench_topdown},
+  {"contention", bench_contention},
+};
+
+int main(int argc, char **argv)
+{
+  const char *only = (argc > 1)? argv[1] : NULL;
+  int n = (argc > 2)? atoi(argv[2]) : 1000000;
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+    if (only == NULL || strcmp(only, "all") == 0 || strcmp(only, benchmarks[i].name) == 0)
+      benchmarks[i].run(n);
+  }
+  return 0;
+}
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "btree_compact.h"
+
+#define INITIAL_CAPACITY 16
+#define MAX_CAPACITY ((uint32_t)UINT32_MAX)
+
+#define L(t, i) ((t)->nodes[i].left)
+#define R(t, i) ((t)->nodes[i].right)
+#define P(t, i) ((t)->nodes[i].parent)
+#define C(t, i) ((t)->nodes[i].color)
+
+BTreeCompact* btree_compact_create(int (*cmp) (void *, void *))
+{
+  BTreeCompact *t = (BTreeCompact*)malloc(sizeof(BTreeCompact));
+  if (t == NULL)
+    return NULL;
+  t->nodes = (CompactNode*)malloc(sizeof(CompactNode) * INITIAL_CAPACITY);
+  if (t->nodes == NULL) {
+    free(t);
+    return NULL;
+  }
+  t->capacity = INITIAL_CAPACITY;
+  t->used = 1;
+  t->free_list = BTREE_NIL;
+  t->root = BTREE_NIL;
+  t->size = 0;
+  t->cmp = cmp;
+  CompactNode nil = {NULL, BTREE_NIL, BTREE_NIL, BTREE_NIL, BTREE_BLACK};
+  t->nodes[BTREE_NIL] = nil;
+  return t;
+}
+
+static uint32_t node_alloc(BTreeCompact *t)
+{
+  if (t->free_list != BTREE_NIL) {
+    uint32_t i = t->free_list;
+    t->free_list = L(t, i);
+    return i;
+  }
+  if (t->used == t->capacity) {
+    if (t->capacity == MAX_CAPACITY)
+      return BTREE_NIL;
+    uint32_t capacity = (t->capacity > MAX_CAPACITY / 2)? MAX_CAPACITY : 2 * t->capacity;
+    CompactNode *nodes = (CompactNode*)realloc(t->nodes, sizeof(CompactNode) * capacity);
+    if (nodes == NULL)
+      return BTREE_NIL;
+    t->nodes = nodes;
+    t->capacity = capacity;
+  }
+  return t->used++;
+}
+
+static void node_free(BTreeCompact *t, uint32_t i)
+{
+  L(t, i) = t->free_list;
+  t->free_list = i;
+}
+
+static void left_rotation(BTreeCompact *t, uint32_t x)
+{
+  uint32_t y = R(t, x);
+  R(t, x) = L(t, y);
+  if (L(t, y) != BTREE_NIL)
+    P(t, L(t, y)) = x;
+  P(t, y) = P(t, x);
+  if (P(t, x) == BTREE_NIL)
+    t->root = y;
+  else if (x == L(t, P(t, x)))
+    L(t, P(t, x)) = y;
+  else
+    R(t, P(t, x)) = y;
+  L(t, y) = x;
+  P(t, x) = y;
+}
+
+static void right_rotation(BTreeCompact *t, uint32_t y)
+{
+  uint32_t x = L(t, y);
+  L(t, y) = R(t, x);
+  if (R(t, x) != BTREE_NIL)
+    P(t, R(t, x)) = y;
+  P(t, x) = P(t, y);
+  if (P(t, y) == BTREE_NIL)
+    t->root = x;
+  else if (y == L(t, P(t, y)))
+    L(t, P(t, y)) = x;
+  else
+    R(t, P(t, y)) = x;
+  R(t, x) = y;
+  P(t, y) = x;
+}
+
+static void insert_fixup(BTreeCompact *t, uint32_t x)
+{
+  while (C(t, P(t, x)) == BTREE_RED) {
+    uint32_t p = P(t, x);
+    uint32_t pp = P(t, p);
+    if (p == L(t, pp)) {
+      uint32_t y = R(t, pp);
+      if (C(t, y) == BTREE_RED) {
+        C(t, p) = BTREE_BLACK;
+        C(t, y) = BTREE_BLACK;
+        C(t, pp) = BTREE_RED;
+        x = pp;
+      } else {
+        if (x == R(t, p)) {
+          x = p;
+          left_rotation(t, x);
+          p = P(t, x);
+        }
+        C(t, p) = BTREE_BLACK;
+        C(t, pp) = BTREE_RED;
+        right_rotation(t, pp);
+      }
+    } else {
+      uint32_t y = L(t, pp);
+      if (C(t, y) == BTREE_RED) {
+        C(t, p) = BTREE_BLACK;
+        C(t, y) = BTREE_BLACK;
+        C(t, pp) = BTREE_RED;
+        x = pp;
+      } else {
+        if (x == L(t, p)) {
+          x = p;
+          right_rotation(t, x);
+          p = P(t, x);
+        }
+        C(t, p) = BTREE_BLACK;
+        C(t, pp) = BTREE_RED;
+        left_rotation(t, pp);
+      }
+    }
+  }
+  C(t, t->root) = BTREE_BLACK;
+}
+
+bool btree_compact_insert(BTreeCompact *t, void *data)
+{
+  uint32_t parent = BTREE_NIL;
+  uint32_t cur = t->root;
+  int cmp_result = 0;
+  while (cur != BTREE_NIL) {
+    cmp_result = (*(t->cmp))(data, t->nodes[cur].data);
+    if (cmp_result == 0)
+      return true;
+    parent = cur;
+    cur = (cmp_result < 0)? L(t, cur) : R(t, cur);
+  }
+  uint32_t x = node_alloc(t);
+  if (x == BTREE_NIL)
+    return false;
+  CompactNode node = {data, BTREE_NIL, BTREE_NIL, parent, BTREE_RED};
+  t->nodes[x] = node;
+  if (parent == BTREE_NIL)
+    t->root = x;
+  else if (cmp_result < 0)
+    L(t, parent) = x;
+  else
+    R(t, parent) = x;
+  t->size += 1;
+  insert_fixup(t, x);
+  return true;
+}
+
+uint32_t btree_compact_find(BTreeCompact *t, void *data)
+{
+  uint32_t cur = t->root;
+  while (cur != BTREE_NIL) {
+    int cmp_result = (*(t->cmp))(data, t->nodes[cur].data);
+    if (cmp_result == 0)
+      break;
+    cur = (cmp_result < 0)? L(t, cur) : R(t, cur);
+  }
+  return cur;
+}
+
+bool btree_compact_member(BTreeCompact *t, void *data)
+{
+  return btree_compact_find(t, data) != BTREE_NIL;
+}
+
+static uint32_t down_to_leftmost_child(BTreeCompact *t, uint32_t i)
+{
+  while (i != BTREE_NIL && L(t, i) != BTREE_NIL)
+    i = L(t, i);
+  return i;
+}
+
+static uint32_t down_to_rightmost_child(BTreeCompact *t, uint32_t i)
+{
+  while (i != BTREE_NIL && R(t, i) != BTREE_NIL)
+    i = R(t, i);
+  return i;
+}
+
+/* Puts 'v' in place of 'u'; sets the sentinel's parent if 'v' is BTREE_NIL. */
+static void transplant(BTreeCompact *t, uint32_t u, uint32_t v)
+{
+  if (P(t, u) == BTREE_NIL)
+    t->root = v;
+  else if (u == L(t, P(t, u)))
+    L(t, P(t, u)) = v;
+  else
+    R(t, P(t, u)) = v;
+  P(t, v) = P(t, u);
+}
+
+static void remove_fixup(BTreeCompact *t, uint32_t x)
+{
+  while (x != t->root && C(t, x) == BTREE_BLACK) {
+    uint32_t xp = P(t, x);
+    if (x == L(t, xp)) {
+      uint32_t w = R(t, xp);
+      if (C(t, w) == BTREE_RED) {
+        C(t, w) = BTREE_BLACK;
+        C(t, xp) = BTREE_RED;
+        left_rotation(t, xp);
+        w = R(t, xp);
+      }
+      if (C(t, L(t, w)) == BTREE_BLACK && C(t, R(t, w)) == BTREE_BLACK) {
+        C(t, w) = BTREE_RED;
+        x = xp;
+      } else {
+        if (C(t, R(t, w)) == BTREE_BLACK) {
+          C(t, L(t, w)) = BTREE_BLACK;
+          C(t, w) = BTREE_RED;
+          right_rotation(t, w);
+          w = R(t, xp);
+        }
+        C(t, w) = C(t, xp);
+        C(t, xp) = BTREE_BLACK;
+        C(t, R(t, w)) = BTREE_BLACK;
+        left_rotation(t, xp);
+        x = t->root;
+      }
+    } else {
+      uint32_t w = L(t, xp);
+      if (C(t, w) == BTREE_RED) {
+        C(t, w) = BTREE_BLACK;
+        C(t, xp) = BTREE_RED;
+        right_rotation(t, xp);
+        w = L(t, xp);
+      }
+      if (C(t, R(t, w)) == BTREE_BLACK && C(t, L(t, w)) == BTREE_BLACK) {
+        C(t, w) = BTREE_RED;
+        x = xp;
+      } else {
+        if (C(t, L(t, w)) == BTREE_BLACK) {
+          C(t, R(t, w)) = BTREE_BLACK;
+          C(t, w) = BTREE_RED;
+          left_rotation(t, w);
+          w = L(t, xp);
+        }
+        C(t, w) = C(t, xp);
+        C(t, xp) = BTREE_BLACK;
+        C(t, L(t, w)) = BTREE_BLACK;
+        right_rotation(t, xp);
+        x = t->root;
+      }
+    }
+  }
+  C(t, x) = BTREE_BLACK;
+}
+
+bool btree_compact_remove(BTreeCompact *t, void *data)
+{
+  uint32_t z = btree_compact_find(t, data);
+  if (z == BTREE_NIL)
+    return false;
+  uint32_t y = z;
+  uint32_t removed_color = C(t, y);
+  uint32_t x;
+  if (L(t, z) == BTREE_NIL) {
+    x = R(t, z);
+    transplant(t, z, x);
+  } else if (R(t, z) == BTREE_NIL) {
+    x = L(t, z);
+    transplant(t, z, x);
+  } else {
+    y = down_to_leftmost_child(t, R(t, z));
+    removed_color = C(t, y);
+    x = R(t, y);
+    if (P(t, y) == z) {
+      P(t, x) = y;
+    } else {
+      transplant(t, y, x);
+      R(t, y) = R(t, z);
+      P(t, R(t, y)) = y;
+    }
+    transplant(t, z, y);
+    L(t, y) = L(t, z);
+    P(t, L(t, y)) = y;
+    C(t, y) = C(t, z);
+  }
+  if (removed_color == BTREE_BLACK)
+    remove_fixup(t, x);
+  P(t, BTREE_NIL) = BTREE_NIL;
+  C(t, BTREE_NIL) = BTREE_BLACK;
+  node_free(t, z);
+  t->size -= 1;
+  return true;
+}
+
+uint32_t btree_compact_begin(BTreeCompact *t)
+{
+  return down_to_leftmost_child(t, t->root);
+}
+
+uint32_t btree_compact_next(BTreeCompact *t, uint32_t i)
+{
+  if (R(t, i) != BTREE_NIL)
+    return down_to_leftmost_child(t, R(t, i));
+  while (P(t, i) != BTREE_NIL && R(t, P(t, i)) == i)
+    i = P(t, i);
+  return P(t, i);
+}
+
+uint32_t btree_compact_rbegin(BTreeCompact *t)
+{
+  return down_to_rightmost_child(t, t->root);
+}
+
+uint32_t btree_compact_prev(BTreeCompact *t, uint32_t i)
+{
+  if (L(t, i) != BTREE_NIL)
+    return down_to_rightmost_child(t, L(t, i));
+  while (P(t, i) != BTREE_NIL && L(t, P(t, i)) == i)
+    i = P(t, i);
+  return P(t, i);
+}
+
+void btree_compact_destroy(BTreeCompact *t)
+{
+  free(t->nodes);
+  free(t);
+}
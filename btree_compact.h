@@ -0,0 +1,77 @@
+#ifndef BTREE_COMPACT
+#define BTREE_COMPACT
+
+#include <stdint.h>
+
+#include "btree.h"
+
+/* Index of the sentinel node standing in for NULL links. */
+#define BTREE_NIL 0
+
+/**
+  * A node of a compact tree. Links are 32-bit indices into the tree's node
+  * array instead of pointers, which halves the node size (24 bytes against
+  * 48 for Node).
+  **/
+struct CompactNode {
+  void *data;
+  uint32_t left;
+  uint32_t right;
+  uint32_t parent;
+  uint32_t color;
+};
+
+/**
+  * Red-black tree keeping all nodes in one growable array, for trees of up
+  * to 2^32 - 2 elements. nodes[BTREE_NIL] is a black sentinel. Freed slots
+  * are chained through 'left' starting at 'free_list'. Indices stay valid
+  * when the array is reallocated; pointers into it do not.
+  **/
+struct BTreeCompact {
+  struct CompactNode *nodes;
+  uint32_t capacity;
+  uint32_t used;
+  uint32_t free_list;
+  uint32_t root;
+  size_t size;
+  int (*cmp)(void *, void *);
+};
+
+typedef struct CompactNode CompactNode;
+typedef struct BTreeCompact BTreeCompact;
+
+BTreeCompact* btree_compact_create(int (*cmp) (void *, void *));
+
+/**
+  * Inserts 'data'. Returns false if the tree is out of memory or indices.
+  **/
+bool btree_compact_insert(BTreeCompact *tree, void *data);
+
+/**
+  * Returns the index of the element equal to 'data', or BTREE_NIL.
+  **/
+uint32_t btree_compact_find(BTreeCompact *tree, void *data);
+
+bool btree_compact_member(BTreeCompact *tree, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none.
+  **/
+bool btree_compact_remove(BTreeCompact *tree, void *data);
+
+/**
+  * In-order iteration: btree_compact_begin returns the index of the smallest
+  * element and btree_compact_next the one following 'i', or BTREE_NIL.
+  * btree_compact_rbegin and btree_compact_prev do the same from the largest.
+  **/
+uint32_t btree_compact_begin(BTreeCompact *tree);
+
+uint32_t btree_compact_next(BTreeCompact *tree, uint32_t i);
+
+uint32_t btree_compact_rbegin(BTreeCompact *tree);
+
+uint32_t btree_compact_prev(BTreeCompact *tree, uint32_t i);
+
+void btree_compact_destroy(BTreeCompact *tree);
+
+#endif  // BTREE_COMPACT
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "btree_fc.h"
+
+/* Marks a successful insert or remove in BTreeFCSlot::result. */
+#define FC_DONE ((void*)1)
+
+BTreeFC* btree_fc_create(BTree *tree, int max_threads)
+{
+  BTreeFC *fc = (BTreeFC*)malloc(sizeof(BTreeFC));
+  if (fc == NULL)
+    return NULL;
+  void *slots = NULL;
+  if (posix_memalign(&slots, BTREE_CACHE_LINE, sizeof(BTreeFCSlot) * max_threads) != 0) {
+    free(fc);
+    return NULL;
+  }
+  fc->slots = (BTreeFCSlot*)slots;
+  for (int i = 0; i < max_threads; ++i) {
+    fc->slots[i].op = BTREE_FC_NONE;
+    fc->slots[i].in_use = 0;
+    fc->slots[i].data = NULL;
+    fc->slots[i].result = NULL;
+  }
+  fc->tree = tree;
+  fc->nslots = max_threads;
+  fc->used = 0;
+  pthread_mutex_init(&fc->lock, NULL);
+  return fc;
+}
+
+int btree_fc_register(BTreeFC *fc)
+{
+  for (int slot = 0; slot < fc->nslots; ++slot) {
+    int free_slot = 0;
+    if (__atomic_load_n(&fc->slots[slot].in_use, __ATOMIC_RELAXED) != 0 ||
+        !__atomic_compare_exchange_n(&fc->slots[slot].in_use, &free_slot, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+    int used = __atomic_load_n(&fc->used, __ATOMIC_RELAXED);
+    while (used <= slot &&
+           !__atomic_compare_exchange_n(&fc->used, &used, slot + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    return slot;
+  }
+  return -1;
+}
+
+void btree_fc_unregister(BTreeFC *fc, int slot)
+{
+  __atomic_store_n(&fc->slots[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void apply(BTree *tree, BTreeFCSlot *s)
+{
+  switch (s->op) {
+  case BTREE_FC_INSERT:
+    s->result = btree_insert(tree, s->data)? FC_DONE : NULL;
+    break;
+  case BTREE_FC_REMOVE: {
+    BTreeIterator it = btree_find(tree, s->data);
+    s->result = (it.node != NULL)? FC_DONE : NULL;
+    btree_remove(it);
+    break;
+  }
+  case BTREE_FC_FIND: {
+    BTreeIterator it = btree_find(tree, s->data);
+    s->result = (it.node != NULL)? it.node->data : NULL;
+    break;
+  }
+  }
+}
+
+/* Applies every published request; the caller holds the lock. */
+static void combine(BTreeFC *fc)
+{
+  int n = __atomic_load_n(&fc->used, __ATOMIC_RELAXED);
+  for (int i = 0; i < n; ++i) {
+    BTreeFCSlot *s = &fc->slots[i];
+    if (__atomic_load_n(&s->op, __ATOMIC_ACQUIRE) == BTREE_FC_NONE)
+      continue;
+    apply(fc->tree, s);
+    __atomic_store_n(&s->op, BTREE_FC_NONE, __ATOMIC_RELEASE);
+  }
+}
+
+static void* execute(BTreeFC *fc, int slot, int op, void *data)
+{
+  BTreeFCSlot *s = &fc->slots[slot];
+  s->data = data;
+  __atomic_store_n(&s->op, op, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&s->op, __ATOMIC_ACQUIRE) != BTREE_FC_NONE) {
+    if (pthread_mutex_trylock(&fc->lock) == 0) {
+      combine(fc);
+      pthread_mutex_unlock(&fc->lock);
+    } else {
+      sched_yield();
+    }
+  }
+  return s->result;
+}
+
+bool btree_fc_insert(BTreeFC *fc, int slot, void *data)
+{
+  return execute(fc, slot, BTREE_FC_INSERT, data) != NULL;
+}
+
+bool btree_fc_remove(BTreeFC *fc, int slot, void *data)
+{
+  return execute(fc, slot, BTREE_FC_REMOVE, data) != NULL;
+}
+
+void* btree_fc_find(BTreeFC *fc, int slot, void *data)
+{
+  return execute(fc, slot, BTREE_FC_FIND, data);
+}
+
+void btree_fc_destroy(BTreeFC *fc)
+{
+  btree_destroy(fc->tree);
+  pthread_mutex_destroy(&fc->lock);
+  free(fc->slots);
+  free(fc);
+}
@@ -0,0 +1,73 @@
+#ifndef BTREE_FC
+#define BTREE_FC
+
+#include <pthread.h>
+
+#include "btree.h"
+
+enum BTreeFCOp {BTREE_FC_NONE, BTREE_FC_INSERT, BTREE_FC_REMOVE, BTREE_FC_FIND};
+
+/**
+  * A publication slot owned by one thread. The owner fills 'data' and then
+  * sets 'op'; the combiner applies the request, stores the outcome and
+  * resets 'op' to BTREE_FC_NONE. 'in_use' is set while a thread owns the
+  * slot.
+  **/
+struct BTreeFCSlot {
+  int op;
+  int in_use;
+  void *data;
+  void *result;
+} __attribute__((aligned(BTREE_CACHE_LINE)));
+
+/**
+  * Flat-combining wrapper around a tree: threads publish requests in their
+  * slots, and whichever thread gets the lock applies every pending request
+  * in one pass, so the tree stays in that thread's cache and the lock
+  * changes hands once per batch instead of once per operation.
+  **/
+struct BTreeFC {
+  BTree *tree;
+  pthread_mutex_t lock;
+  int nslots;
+  int used;
+  struct BTreeFCSlot *slots;
+};
+
+typedef struct BTreeFCSlot BTreeFCSlot;
+typedef struct BTreeFC BTreeFC;
+
+/**
+  * Wraps 'tree' for at most 'max_threads' threads at a time. The wrapper owns
+  * the tree from now on and destroys it in btree_fc_destroy. 'used' is one
+  * past the highest slot ever taken, which bounds the combiner's scan.
+  **/
+BTreeFC* btree_fc_create(BTree *tree, int max_threads);
+
+/**
+  * Reserves a slot for the calling thread. Returns its index, to be passed to
+  * every later call from that thread, or -1 if all slots are taken.
+  **/
+int btree_fc_register(BTreeFC *fc);
+
+/**
+  * Gives the slot back, e.g. before the thread exits, so that another thread
+  * can register. The thread must not use the slot afterwards.
+  **/
+void btree_fc_unregister(BTreeFC *fc, int slot);
+
+bool btree_fc_insert(BTreeFC *fc, int slot, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none.
+  **/
+bool btree_fc_remove(BTreeFC *fc, int slot, void *data);
+
+/**
+  * Returns the stored element equal to 'data', or NULL.
+  **/
+void* btree_fc_find(BTreeFC *fc, int slot, void *data);
+
+void btree_fc_destroy(BTreeFC *fc);
+
+#endif  // BTREE_FC
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "btree_heat.h"
+
+void btree_heat_enable(BTree *tree, unsigned sample_every)
+{
+  __atomic_store_n(&tree->heat_ticks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&tree->heat_sample, sample_every, __ATOMIC_RELAXED);
+}
+
+static void reset_helper(Node *n)
+{
+  if (n == NULL)
+    return;
+  n->hits = 0;
+  reset_helper(n->left);
+  reset_helper(n->right);
+}
+
+void btree_heat_reset(BTree *tree)
+{
+  reset_helper(tree->root);
+}
+
+/* Restores the min-heap order of 'heap' below index 'i'. */
+static void sift_down(Node **heap, size_t n, size_t i)
+{
+  for (;;) {
+    size_t min = i;
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    if (l < n && heap[l]->hits < heap[min]->hits)
+      min = l;
+    if (r < n && heap[r]->hits < heap[min]->hits)
+      min = r;
+    if (min == i)
+      return;
+    Node *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+static void sift_up(Node **heap, size_t i)
+{
+  while (i > 0 && heap[(i - 1) / 2]->hits > heap[i]->hits) {
+    Node *tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static void top_helper(Node *n, Node **heap, size_t k, size_t *count)
+{
+  if (n == NULL)
+    return;
+  if (n->hits > 0) {
+    if (*count < k) {
+      heap[*count] = n;
+      sift_up(heap, (*count)++);
+    } else if (n->hits > heap[0]->hits) {
+      heap[0] = n;
+      sift_down(heap, k, 0);
+    }
+  }
+  top_helper(n->left, heap, k, count);
+  top_helper(n->right, heap, k, count);
+}
+
+size_t btree_heat_top(BTree *tree, Node **out, size_t k)
+{
+  size_t count = 0;
+  if (k == 0)
+    return 0;
+  top_helper(tree->root, out, k, &count);
+  for (size_t n = count; n > 1; --n) {
+    Node *tmp = out[0];
+    out[0] = out[n - 1];
+    out[n - 1] = tmp;
+    sift_down(out, n - 1, 0);
+  }
+  return count;
+}
+
+static int depth_helper(Node *n, int depth, uint64_t *hist, int levels)
+{
+  if (n == NULL)
+    return depth;
+  if (depth < levels)
+    hist[depth] += n->hits;
+  int l = depth_helper(n->left, depth + 1, hist, levels);
+  int r = depth_helper(n->right, depth + 1, hist, levels);
+  return (l > r)? l : r;
+}
+
+int btree_heat_by_depth(BTree *tree, uint64_t *hist, int levels)
+{
+  memset(hist, 0, sizeof(uint64_t) * levels);
+  return depth_helper(tree->root, 0, hist, levels);
+}
+
+int btree_heat_attributes(Node *n, char *buf, size_t size, void *arg)
+{
+  uint32_t max = *(uint32_t*)arg;
+  double heat = (max == 0)? 0.0 : (double)n->hits / max;
+  return snprintf(buf, size, "[label=\"%u\", style=filled, fillcolor=\"0.000 %.3f 1.000\"]",
+                  n->hits, (heat > 1.0)? 1.0 : heat);
+}
@@ -0,0 +1,37 @@
+#ifndef BTREE_HEAT
+#define BTREE_HEAT
+
+#include "btree.h"
+
+/**
+  * Starts counting one in 'sample_every' accesses made through btree_find,
+  * btree_member, btree_begin and btree_next in the 'hits' field of the node
+  * reached; 0 stops counting. Counters saturate at UINT32_MAX. Counting uses
+  * relaxed atomics, so those lookups may still run concurrently (e.g. under a
+  * shared lock); the other functions here need exclusive access.
+  **/
+void btree_heat_enable(BTree *tree, unsigned sample_every);
+
+void btree_heat_reset(BTree *tree);
+
+/**
+  * Stores up to 'k' of the most accessed nodes in 'out', hottest first, and
+  * returns how many were stored. Nodes without hits are left out.
+  **/
+size_t btree_heat_top(BTree *tree, Node **out, size_t k);
+
+/**
+  * Sets hist[d] to the hits of the nodes at depth d (the root is at depth 0)
+  * for d < 'levels' and returns the tree height, so a caller can tell
+  * whether the hot keys sit near the leaves.
+  **/
+int btree_heat_by_depth(BTree *tree, uint64_t *hist, int levels);
+
+/**
+  * Attribute formatter for btree_dump_dot_to: labels each node with its
+  * hits and fills it from white to red relative to *(uint32_t*)arg, the
+  * hits of the hottest node (see btree_heat_top).
+  **/
+int btree_heat_attributes(Node *n, char *buf, size_t size, void *arg);
+
+#endif  // BTREE_HEAT
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <sched.h>
+
+#include "btree_hoh.h"
+
+#define COLOR(node) (((node) == NULL)? BTREE_BLACK : (node)->color)
+
+/*
+ * Number of locks a writer holds along its path: a rotation at the
+ * grandparent of the current node also rewrites the link above it.
+ */
+#define WINDOW 4
+
+/*
+ * The locked suffix of the current search path, top first. Each entry is the
+ * parent of the next one. 'pinned' is the node a remove matched, kept locked
+ * after it leaves the window; 'side' holds the two nodes a double rotation
+ * left locked below the current one until the next step picks one of them.
+ */
+struct Window {
+  HohNode *n[WINDOW + 1];
+  int len;
+  HohNode *pinned;
+  HohNode *side[2];
+};
+
+typedef struct Window Window;
+
+BTreeHoh* btree_hoh_create(int (*cmp) (void *, void *))
+{
+  BTreeHoh *t = (BTreeHoh*)malloc(sizeof(BTreeHoh));
+  if (t == NULL)
+    return NULL;
+  t->head.link[0] = NULL;
+  t->head.link[1] = NULL;
+  t->head.data = NULL;
+  t->head.color = BTREE_BLACK;
+  t->head.lock = 0;
+  t->size = 0;
+  t->cmp = cmp;
+  return t;
+}
+
+/* A lock holder may be descheduled, so waiters yield instead of spinning. */
+static void node_lock(HohNode *n)
+{
+  while (__atomic_exchange_n(&n->lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&n->lock, __ATOMIC_RELAXED))
+      sched_yield();
+  }
+}
+
+static void node_unlock(HohNode *n)
+{
+  __atomic_store_n(&n->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Rotates 'n' towards 'dir' and returns the node that takes its place. */
+static HohNode* rotate(HohNode *n, int dir)
+{
+  HohNode *s = n->link[!dir];
+  n->link[!dir] = s->link[dir];
+  s->link[dir] = n;
+  return s;
+}
+
+static void window_init(Window *w, BTreeHoh *t)
+{
+  node_lock(&t->head);
+  w->n[0] = &t->head;
+  w->len = 1;
+  w->pinned = NULL;
+  w->side[0] = NULL;
+  w->side[1] = NULL;
+}
+
+/* Puts the locked node 'n' at 'pos' and drops the top entry if full. */
+static void window_insert(Window *w, int pos, HohNode *n)
+{
+  for (int i = w->len; i > pos; --i)
+    w->n[i] = w->n[i - 1];
+  w->n[pos] = n;
+  if (++w->len > WINDOW) {
+    if (w->n[0] != w->pinned)
+      node_unlock(w->n[0]);
+    for (int i = 1; i < w->len; ++i)
+      w->n[i - 1] = w->n[i];
+    w->len -= 1;
+  }
+}
+
+/* Steps to 'next', a child of the last node of the window. */
+static void window_descend(Window *w, HohNode *next)
+{
+  if (w->side[0] != NULL) {
+    // next is one of them: a double rotation made both children of the
+    // current node.
+    node_unlock((next == w->side[0])? w->side[1] : w->side[0]);
+    w->side[0] = NULL;
+    w->side[1] = NULL;
+  } else {
+    node_lock(next);
+  }
+  window_insert(w, w->len, next);
+}
+
+static void window_release(Window *w)
+{
+  bool pinned = false;
+  for (int i = 0; i < w->len; ++i) {
+    pinned |= (w->n[i] == w->pinned);
+    node_unlock(w->n[i]);
+  }
+  if (w->pinned != NULL && !pinned)
+    node_unlock(w->pinned);
+  for (int i = 0; i < 2; ++i) {
+    if (w->side[i] != NULL)
+      node_unlock(w->side[i]);
+  }
+}
+
+/*
+ * Resolves a red last node under a red parent, as split_red_pair does. The
+ * window then ends at the new top of the rotated subtree or below it.
+ */
+static void split_red_pair(Window *w)
+{
+  int len = w->len;
+  HohNode *x = w->n[len - 1];
+  HohNode *p = w->n[len - 2];
+  if (COLOR(p) != BTREE_RED)
+    return;
+  // p is red, so it is not the root and g has a parent in the window.
+  HohNode *g = w->n[len - 3];
+  HohNode *above = w->n[len - 4];
+  int dir = (p == g->link[1]);
+  int gdir = (g == above->link[1]);
+  if ((x == p->link[1]) == dir) {
+    above->link[gdir] = rotate(g, !dir);
+    p->color = BTREE_BLACK;
+    g->color = BTREE_RED;
+    node_unlock(g);
+    w->n[len - 3] = p;
+    w->n[len - 2] = x;
+    w->len -= 1;
+  } else {
+    g->link[dir] = rotate(p, dir);
+    above->link[gdir] = rotate(g, !dir);
+    x->color = BTREE_BLACK;
+    g->color = BTREE_RED;
+    w->n[len - 3] = x;
+    w->len -= 2;
+    w->side[0] = p;
+    w->side[1] = g;
+  }
+}
+
+bool btree_hoh_insert(BTreeHoh *t, void *data)
+{
+  HohNode *x = (HohNode*)malloc(sizeof(HohNode));
+  if (x == NULL)
+    return false;
+  x->link[0] = NULL;
+  x->link[1] = NULL;
+  x->data = data;
+  x->color = BTREE_RED;
+  x->lock = 0;
+
+  Window w;
+  window_init(&w, t);
+  HohNode *n = t->head.link[1];
+  if (n == NULL) {
+    x->color = BTREE_BLACK;
+    t->head.link[1] = x;
+    __atomic_fetch_add(&t->size, 1, __ATOMIC_RELAXED);
+    window_release(&w);
+    return true;
+  }
+  window_descend(&w, n);
+  for (;;) {
+    if (COLOR(n->link[0]) == BTREE_RED && COLOR(n->link[1]) == BTREE_RED) {
+      n->link[0]->color = BTREE_BLACK;
+      n->link[1]->color = BTREE_BLACK;
+      if (w.n[w.len - 2] != &t->head) {
+        n->color = BTREE_RED;
+        split_red_pair(&w);
+      }
+    }
+    int cmp_result = t->cmp(data, n->data);
+    if (cmp_result == 0) {
+      window_release(&w);
+      free(x);
+      return false;
+    }
+    HohNode *next = n->link[cmp_result > 0];
+    if (next == NULL) {
+      n->link[cmp_result > 0] = x;
+      node_lock(x);
+      window_insert(&w, w.len, x);
+      split_red_pair(&w);
+      break;
+    }
+    window_descend(&w, next);
+    n = next;
+  }
+  __atomic_fetch_add(&t->size, 1, __ATOMIC_RELAXED);
+  window_release(&w);
+  return true;
+}
+
+void* btree_hoh_find(BTreeHoh *t, void *data)
+{
+  HohNode *parent = &t->head;
+  node_lock(parent);
+  HohNode *n = parent->link[1];
+  while (n != NULL) {
+    node_lock(n);
+    node_unlock(parent);
+    int cmp_result = t->cmp(data, n->data);
+    if (cmp_result == 0) {
+      void *res = n->data;
+      node_unlock(n);
+      return res;
+    }
+    parent = n;
+    n = n->link[cmp_result > 0];
+  }
+  node_unlock(parent);
+  return NULL;
+}
+
+bool btree_hoh_member(BTreeHoh *t, void *data)
+{
+  return btree_hoh_find(t, data) != NULL;
+}
+
+bool btree_hoh_remove(BTreeHoh *t, void *data)
+{
+  Window w;
+  window_init(&w, t);
+  HohNode *q = t->head.link[1];
+  if (q == NULL) {
+    window_release(&w);
+    return false;
+  }
+  window_descend(&w, q);
+  for (;;) {
+    // Once the element is found, descend to its predecessor.
+    int cmp_result = (w.pinned == NULL)? t->cmp(data, q->data) : 1;
+    if (cmp_result == 0)
+      w.pinned = q;
+    int dir = (cmp_result > 0);
+    HohNode *next = q->link[dir];
+    // Make sure q is red before stepping below it; p is red or the root.
+    HohNode *p = w.n[w.len - 2];
+    if (COLOR(q) == BTREE_BLACK && COLOR(next) == BTREE_BLACK) {
+      if (COLOR(q->link[!dir]) == BTREE_RED) {
+        HohNode *r = q->link[!dir];
+        node_lock(r);
+        p->link[q == p->link[1]] = rotate(q, dir);
+        r->color = BTREE_BLACK;
+        q->color = BTREE_RED;
+        window_insert(&w, w.len - 1, r);
+      } else if (p != &t->head) {
+        int last = (q == p->link[1]);
+        HohNode *s = p->link[!last];
+        node_lock(s);
+        if (COLOR(s->link[0]) == BTREE_BLACK && COLOR(s->link[1]) == BTREE_BLACK) {
+          p->color = BTREE_BLACK;
+          s->color = BTREE_RED;
+          q->color = BTREE_RED;
+          node_unlock(s);
+        } else {
+          HohNode *g = w.n[w.len - 3];
+          HohNode *m = s->link[last];
+          if (COLOR(m) == BTREE_RED) {
+            node_lock(m);
+            p->link[!last] = rotate(s, !last);
+          }
+          HohNode *top = rotate(p, last);
+          g->link[p == g->link[1]] = top;
+          q->color = BTREE_RED;
+          // The root stays black: nobody here holds the lock of its parent
+          // any more when the tree is next descended.
+          top->color = (g == &t->head)? BTREE_BLACK : BTREE_RED;
+          top->link[0]->color = BTREE_BLACK;
+          top->link[1]->color = BTREE_BLACK;
+          if (top != s)
+            node_unlock(s);
+          window_insert(&w, w.len - 2, top);
+        }
+      }
+    }
+    if (next == NULL)
+      break;
+    window_descend(&w, next);
+    q = next;
+  }
+
+  HohNode *f = w.pinned;
+  if (f != NULL) {
+    // q is red unless it is the root, so unlinking it needs no fixup.
+    HohNode *p = w.n[w.len - 2];
+    f->data = q->data;
+    p->link[q == p->link[1]] = (q->link[0] != NULL)? q->link[0] : q->link[1];
+    __atomic_fetch_sub(&t->size, 1, __ATOMIC_RELAXED);
+  }
+  window_release(&w);
+  if (f != NULL)
+    free(q);
+  return f != NULL;
+}
+
+size_t btree_hoh_size(BTreeHoh *t)
+{
+  return __atomic_load_n(&t->size, __ATOMIC_RELAXED);
+}
+
+void btree_hoh_destroy(BTreeHoh *t)
+{
+  // Same constant-space teardown as btree_destroy_step.
+  HohNode *root = t->head.link[1];
+  while (root != NULL) {
+    HohNode *n = root;
+    if (n->link[0] != NULL) {
+      root = rotate(n, 1);
+    } else {
+      root = n->link[1];
+      free(n);
+    }
+  }
+  free(t);
+}
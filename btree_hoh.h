@@ -0,0 +1,67 @@
+#ifndef BTREE_HOH
+#define BTREE_HOH
+
+#include "btree.h"
+
+/**
+  * A node of a hand-over-hand tree. 'lock' guards the two child links; the
+  * color of a node is guarded by the lock of its parent, so a thread holding
+  * a node may read and recolor its children without locking them.
+  **/
+struct HohNode {
+  struct HohNode *link[2];
+  void *data;
+  NodeColor color;
+  int lock;
+};
+
+/**
+  * Red-black tree for concurrent writers. Every operation descends from
+  * 'head', a sentinel whose right link is the root, locking each node before
+  * releasing one further up (lock coupling). Insert and remove rebalance on
+  * the way down, as btree_insert_topdown and btree_remove_topdown do, so a
+  * writer only ever restructures the few nodes it holds just above its
+  * position and never needs to climb back. Writers in different subtrees
+  * therefore run in parallel once their paths diverge.
+  *
+  * Locks are always taken downwards, which makes the scheme deadlock-free.
+  * A remove keeps the node it matched locked until it is done, since the
+  * element found further down is moved into it.
+  **/
+struct BTreeHoh {
+  struct HohNode head;
+  size_t size;
+  int (*cmp)(void *, void *);
+};
+
+typedef struct HohNode HohNode;
+typedef struct BTreeHoh BTreeHoh;
+
+BTreeHoh* btree_hoh_create(int (*cmp) (void *, void *));
+
+/**
+  * Inserts 'data'. Returns false if an equal element is present or the tree
+  * is out of memory. Safe to call from any number of threads.
+  **/
+bool btree_hoh_insert(BTreeHoh *tree, void *data);
+
+/**
+  * Returns the stored element equal to 'data', or NULL.
+  **/
+void* btree_hoh_find(BTreeHoh *tree, void *data);
+
+bool btree_hoh_member(BTreeHoh *tree, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none.
+  **/
+bool btree_hoh_remove(BTreeHoh *tree, void *data);
+
+size_t btree_hoh_size(BTreeHoh *tree);
+
+/**
+  * Frees the tree. No other thread may be using it.
+  **/
+void btree_hoh_destroy(BTreeHoh *tree);
+
+#endif  // BTREE_HOH
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "btree_interval.h"
+
+#define INTERVAL(node) ((BTreeInterval*)(node)->data)
+
+static int interval_compare(void *va, void *vb)
+{
+  BTreeInterval *a = (BTreeInterval*)va;
+  BTreeInterval *b = (BTreeInterval*)vb;
+  if (a->start != b->start)
+    return (a->start < b->start)? -1 : 1;
+  if (a->end != b->end)
+    return (a->end < b->end)? -1 : 1;
+  if (a != b)
+    return ((uintptr_t)a < (uintptr_t)b)? -1 : 1;
+  return 0;
+}
+
+static void interval_augment(Node *n)
+{
+  BTreeInterval *iv = INTERVAL(n);
+  int64_t max_end = iv->end;
+  if (n->left != NULL && INTERVAL(n->left)->max_end > max_end)
+    max_end = INTERVAL(n->left)->max_end;
+  if (n->right != NULL && INTERVAL(n->right)->max_end > max_end)
+    max_end = INTERVAL(n->right)->max_end;
+  iv->max_end = max_end;
+}
+
+BTree* btree_interval_create()
+{
+  return btree_create_augmented(interval_compare, interval_augment);
+}
+
+bool btree_interval_insert(BTree *tree, BTreeInterval *iv)
+{
+  iv->max_end = iv->end;
+  return btree_insert(tree, (void*)iv);
+}
+
+void btree_interval_remove(BTree *tree, BTreeInterval *iv)
+{
+  btree_remove(btree_find(tree, (void*)iv));
+}
+
+static size_t overlaps_helper(Node *n, int64_t a, int64_t b,
+    void (*cb)(BTreeInterval *iv, void *arg), void *arg)
+{
+  if (n == NULL || INTERVAL(n)->max_end < a)
+    return 0;
+  size_t found = overlaps_helper(n->left, a, b, cb, arg);
+  BTreeInterval *iv = INTERVAL(n);
+  if (iv->start > b)
+    return found;
+  if (iv->end >= a) {
+    cb(iv, arg);
+    found += 1;
+  }
+  return found + overlaps_helper(n->right, a, b, cb, arg);
+}
+
+size_t btree_interval_overlaps(BTree *tree, int64_t a, int64_t b,
+    void (*cb)(BTreeInterval *iv, void *arg), void *arg)
+{
+  return overlaps_helper(tree->root, a, b, cb, arg);
+}
+
+size_t btree_interval_stab(BTree *tree, int64_t point,
+    void (*cb)(BTreeInterval *iv, void *arg), void *arg)
+{
+  return overlaps_helper(tree->root, point, point, cb, arg);
+}
@@ -0,0 +1,48 @@
+#ifndef BTREE_INTERVAL
+#define BTREE_INTERVAL
+
+#include <stdint.h>
+
+#include "btree.h"
+
+/**
+  * A closed interval [start, end] stored in an interval tree. 'max_end' is
+  * maintained by the tree and holds the largest 'end' in the node's subtree.
+  * The client owns the structure and must not modify 'start' and 'end'
+  * while it is in the tree.
+  **/
+struct BTreeInterval {
+  int64_t start;
+  int64_t end;
+  int64_t max_end;
+  void *data;
+};
+
+typedef struct BTreeInterval BTreeInterval;
+
+/**
+  * Creates an interval tree. Intervals are ordered by start, then by end;
+  * equal intervals are told apart by their address, so the same bounds may
+  * be inserted several times with different payloads.
+  **/
+BTree* btree_interval_create();
+
+bool btree_interval_insert(BTree *tree, BTreeInterval *iv);
+
+void btree_interval_remove(BTree *tree, BTreeInterval *iv);
+
+/**
+  * Calls 'cb' for every interval overlapping [a, b], in order of start.
+  * Subtrees whose 'max_end' lies before 'a' or whose starts lie after 'b'
+  * are never entered. Returns the number of reported intervals.
+  **/
+size_t btree_interval_overlaps(BTree *tree, int64_t a, int64_t b,
+    void (*cb)(BTreeInterval *iv, void *arg), void *arg);
+
+/**
+  * Calls 'cb' for every interval containing 'point'.
+  **/
+size_t btree_interval_stab(BTree *tree, int64_t point,
+    void (*cb)(BTreeInterval *iv, void *arg), void *arg);
+
+#endif  // BTREE_INTERVAL
@@ -0,0 +1,392 @@
+#include <stdlib.h>
+
+#include "btree_lean.h"
+
+#define COLOR(node) (((node) == NULL)? BTREE_BLACK : (node)->color)
+
+/*
+ * Most nodes a write to a shared tree copies, for a search path of 'depth'
+ * nodes: the path, one sibling per level rebalancing climbs, and the few
+ * nodes around the final rotations.
+ */
+#define MAX_COPIES(depth) (2 * (depth) + 4)
+
+BTreeLean* btree_lean_create(int (*cmp) (void *, void *))
+{
+  BTreeLean *t = (BTreeLean*)malloc(sizeof(BTreeLean));
+  if (t == NULL)
+    return NULL;
+  t->root = NULL;
+  t->size = 0;
+  t->cmp = cmp;
+  t->shared = false;
+  t->spare = NULL;
+  t->spares = 0;
+  return t;
+}
+
+BTreeLean* btree_lean_clone(BTreeLean *t)
+{
+  BTreeLean *c = (BTreeLean*)malloc(sizeof(BTreeLean));
+  if (c == NULL)
+    return NULL;
+  c->root = t->root;
+  c->size = t->size;
+  c->cmp = t->cmp;
+  c->shared = true;
+  c->spare = NULL;
+  c->spares = 0;
+  t->shared = true;
+  if (t->root != NULL)
+    __atomic_add_fetch(&t->root->refs, 1, __ATOMIC_RELAXED);
+  return c;
+}
+
+/* Drops a reference to 'n' and frees whatever no tree uses any more. */
+static void release(LeanNode *n)
+{
+  while (n != NULL && __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    release(n->link[0]);
+    LeanNode *right = n->link[1];
+    free(n);
+    n = right;
+  }
+}
+
+/*
+ * Links the next 'count' elements of 'it' into a balanced subtree whose root
+ * is at 'depth'. Nodes at 'red_depth', the last and incomplete level, are
+ * red; every other level is full and black.
+ */
+static LeanNode* from_helper(BTreeIterator *it, size_t count, int depth, int red_depth,
+                             bool *failed)
+{
+  if (count == 0 || *failed)
+    return NULL;
+  LeanNode *left = from_helper(it, count / 2, depth + 1, red_depth, failed);
+  LeanNode *n = (*failed)? NULL : (LeanNode*)malloc(sizeof(LeanNode));
+  if (n == NULL) {
+    *failed = true;
+    release(left);
+    return NULL;
+  }
+  n->data = it->node->data;
+  n->color = (depth == red_depth)? BTREE_RED : BTREE_BLACK;
+  n->refs = 1;
+  n->link[0] = left;
+  *it = btree_next(*it);
+  n->link[1] = from_helper(it, count - count / 2 - 1, depth + 1, red_depth, failed);
+  if (*failed) {
+    release(n);
+    return NULL;
+  }
+  return n;
+}
+
+BTreeLean* btree_lean_from(BTree *tree)
+{
+  if (tree->cmp == NULL)
+    return NULL;
+  BTreeLean *t = btree_lean_create(tree->cmp);
+  if (t == NULL)
+    return NULL;
+  int red_depth = 0;
+  while (((size_t)2 << red_depth) - 1 <= tree->size)
+    red_depth += 1;
+  BTreeIterator it = btree_begin(tree);
+  bool failed = false;
+  t->root = from_helper(&it, tree->size, 0, red_depth, &failed);
+  if (failed) {
+    free(t);
+    return NULL;
+  }
+  t->size = tree->size;
+  return t;
+}
+
+/* Fills the spare list up to 'count' nodes. Returns false if memory runs out. */
+static bool reserve(BTreeLean *t, int count)
+{
+  while (t->spares < count) {
+    LeanNode *n = (LeanNode*)malloc(sizeof(LeanNode));
+    if (n == NULL)
+      return false;
+    n->link[0] = t->spare;
+    t->spare = n;
+    t->spares += 1;
+  }
+  return true;
+}
+
+/*
+ * Makes the node at '*link' private to the tree and returns it. A shared
+ * node is replaced by a spare copy, which takes over its references to the
+ * children. Once refs is 1 no other tree can reach the node, so nothing
+ * else can change it.
+ */
+static LeanNode* own(BTreeLean *t, LeanNode **link)
+{
+  LeanNode *n = *link;
+  if (n == NULL || __atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1)
+    return n;
+  LeanNode *c = t->spare;
+  t->spare = c->link[0];
+  t->spares -= 1;
+  c->data = n->data;
+  c->color = n->color;
+  c->refs = 1;
+  for (int i = 0; i < 2; ++i) {
+    c->link[i] = n->link[i];
+    if (c->link[i] != NULL)
+      __atomic_add_fetch(&c->link[i]->refs, 1, __ATOMIC_RELAXED);
+  }
+  *link = c;
+  release(n);
+  return c;
+}
+
+/* Rotates 'n' towards 'dir' and returns the node that takes its place. */
+static LeanNode* rotate(LeanNode *n, int dir)
+{
+  LeanNode *s = n->link[!dir];
+  n->link[!dir] = s->link[dir];
+  s->link[dir] = n;
+  return s;
+}
+
+/* The link that leads to path[i]. */
+static LeanNode** link_to(BTreeLean *t, LeanNode **path, int *dirs, int i)
+{
+  return (i == 0)? &t->root : &path[i - 1]->link[dirs[i - 1]];
+}
+
+/* Points the link that led to path[i] at 'n'. */
+static void replace(BTreeLean *t, LeanNode **path, int *dirs, int i, LeanNode *n)
+{
+  *link_to(t, path, dirs, i) = n;
+}
+
+/*
+ * Before a write to a shared tree: reserves the copies the write may need
+ * and makes the first 'depth' nodes of the path private, top down.
+ */
+static bool own_path(BTreeLean *t, LeanNode **path, int *dirs, int depth)
+{
+  if (!t->shared)
+    return true;
+  if (!reserve(t, MAX_COPIES(depth)))
+    return false;
+  for (int i = 0; i < depth; ++i)
+    path[i] = own(t, link_to(t, path, dirs, i));
+  return true;
+}
+
+bool btree_lean_insert(BTreeLean *t, void *data)
+{
+  LeanNode *path[BTREE_LEAN_MAX_HEIGHT];
+  int dirs[BTREE_LEAN_MAX_HEIGHT];
+  int top = 0;
+  LeanNode *n = t->root;
+  while (n != NULL) {
+    int cmp_result = t->cmp(data, n->data);
+    if (cmp_result == 0)
+      return false;
+    path[top] = n;
+    dirs[top++] = cmp_result > 0;
+    n = n->link[cmp_result > 0];
+  }
+  LeanNode *x = (LeanNode*)malloc(sizeof(LeanNode));
+  if (x == NULL)
+    return false;
+  if (!own_path(t, path, dirs, top)) {
+    free(x);
+    return false;
+  }
+  x->link[0] = NULL;
+  x->link[1] = NULL;
+  x->data = data;
+  x->color = BTREE_RED;
+  x->refs = 1;
+  replace(t, path, dirs, top, x);
+  t->size += 1;
+
+  // path[top - 1] is the parent of x and path[top - 2] its grandparent.
+  while (top >= 2 && path[top - 1]->color == BTREE_RED) {
+    LeanNode *g = path[top - 2];
+    int pd = dirs[top - 2];
+    LeanNode *u = g->link[!pd];
+    if (COLOR(u) == BTREE_RED) {
+      u = own(t, &g->link[!pd]);
+      path[top - 1]->color = BTREE_BLACK;
+      u->color = BTREE_BLACK;
+      g->color = BTREE_RED;
+      top -= 2;
+      continue;
+    }
+    if (dirs[top - 1] != pd)
+      g->link[pd] = rotate(path[top - 1], pd);
+    g->link[pd]->color = BTREE_BLACK;
+    g->color = BTREE_RED;
+    replace(t, path, dirs, top - 2, rotate(g, !pd));
+    break;
+  }
+  t->root->color = BTREE_BLACK;
+  return true;
+}
+
+void* btree_lean_find(BTreeLean *t, void *data)
+{
+  LeanNode *n = t->root;
+  while (n != NULL) {
+    int cmp_result = t->cmp(data, n->data);
+    if (cmp_result == 0)
+      return n->data;
+    n = n->link[cmp_result > 0];
+  }
+  return NULL;
+}
+
+bool btree_lean_member(BTreeLean *t, void *data)
+{
+  return btree_lean_find(t, data) != NULL;
+}
+
+bool btree_lean_remove(BTreeLean *t, void *data)
+{
+  // One more slot than insert: the red-sibling case lengthens the path once.
+  LeanNode *path[BTREE_LEAN_MAX_HEIGHT + 1];
+  int dirs[BTREE_LEAN_MAX_HEIGHT + 1];
+  int top = 0;
+  LeanNode *z = t->root;
+  while (z != NULL) {
+    int cmp_result = t->cmp(data, z->data);
+    if (cmp_result == 0)
+      break;
+    path[top] = z;
+    dirs[top++] = cmp_result > 0;
+    z = z->link[cmp_result > 0];
+  }
+  if (z == NULL)
+    return false;
+
+  // Unlink y, which is z or, if z has two children, z's successor.
+  LeanNode *y = z;
+  int zi = top;
+  if (z->link[0] != NULL && z->link[1] != NULL) {
+    path[top] = z;
+    dirs[top++] = 1;
+    y = z->link[1];
+    while (y->link[0] != NULL) {
+      path[top] = y;
+      dirs[top++] = 0;
+      y = y->link[0];
+    }
+  }
+  if (!own_path(t, path, dirs, top))
+    return false;
+  if (y != z)
+    path[zi]->data = y->data;
+  LeanNode *x = (y->link[0] != NULL)? y->link[0] : y->link[1];
+  replace(t, path, dirs, top, x);
+  NodeColor removed = y->color;
+  if (t->shared) {
+    // y may live on in other trees, which keep their own link to x.
+    if (x != NULL)
+      __atomic_add_fetch(&x->refs, 1, __ATOMIC_RELAXED);
+    release(y);
+  } else {
+    free(y);
+  }
+  t->size -= 1;
+  if (removed == BTREE_RED)
+    return true;
+  if (COLOR(x) == BTREE_RED) {
+    own(t, link_to(t, path, dirs, top))->color = BTREE_BLACK;
+    return true;
+  }
+
+  // The subtree at path[top - 1]->link[dirs[top - 1]] is one black short.
+  while (top > 0) {
+    LeanNode *p = path[top - 1];
+    int d = dirs[top - 1];
+    LeanNode *s = own(t, &p->link[!d]);
+    if (s->color == BTREE_RED) {
+      s->color = BTREE_BLACK;
+      p->color = BTREE_RED;
+      replace(t, path, dirs, top - 1, rotate(p, d));
+      path[top - 1] = s;
+      path[top] = p;
+      dirs[top++] = d;
+      s = own(t, &p->link[!d]);
+    }
+    if (COLOR(s->link[0]) == BTREE_BLACK && COLOR(s->link[1]) == BTREE_BLACK) {
+      s->color = BTREE_RED;
+      if (p->color == BTREE_RED) {
+        p->color = BTREE_BLACK;
+        break;
+      }
+      top -= 1;
+      continue;
+    }
+    if (COLOR(s->link[!d]) == BTREE_BLACK) {
+      own(t, &s->link[d])->color = BTREE_BLACK;
+      s->color = BTREE_RED;
+      p->link[!d] = rotate(s, !d);
+      s = p->link[!d];
+    }
+    s->color = p->color;
+    p->color = BTREE_BLACK;
+    own(t, &s->link[!d])->color = BTREE_BLACK;
+    replace(t, path, dirs, top - 1, rotate(p, d));
+    break;
+  }
+  return true;
+}
+
+/* Pushes 'n' and its chain of left children. */
+static void push_left(BTreeLeanCursor *c, LeanNode *n)
+{
+  for (; n != NULL; n = n->link[0])
+    c->stack[c->depth++] = n;
+}
+
+void* btree_lean_first(BTreeLean *t, BTreeLeanCursor *c)
+{
+  c->depth = 0;
+  push_left(c, t->root);
+  return (c->depth == 0)? NULL : c->stack[c->depth - 1]->data;
+}
+
+void* btree_lean_next(BTreeLeanCursor *c)
+{
+  if (c->depth == 0)
+    return NULL;
+  LeanNode *n = c->stack[--c->depth];
+  push_left(c, n->link[1]);
+  return (c->depth == 0)? NULL : c->stack[c->depth - 1]->data;
+}
+
+void btree_lean_destroy(BTreeLean *t)
+{
+  while (t->spare != NULL) {
+    LeanNode *n = t->spare;
+    t->spare = n->link[0];
+    free(n);
+  }
+  if (t->shared) {
+    release(t->root);
+    free(t);
+    return;
+  }
+  // Same constant-space teardown as btree_destroy_step.
+  while (t->root != NULL) {
+    LeanNode *n = t->root;
+    if (n->link[0] != NULL) {
+      t->root = rotate(n, 1);
+    } else {
+      t->root = n->link[1];
+      free(n);
+    }
+  }
+  free(t);
+}
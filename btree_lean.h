@@ -0,0 +1,108 @@
+#ifndef BTREE_LEAN
+#define BTREE_LEAN
+
+#include "btree.h"
+
+/* No red-black tree addressable with 64-bit pointers is deeper than this. */
+#define BTREE_LEAN_MAX_HEIGHT 128
+
+/**
+  * A node of a lean tree: no parent link and no cached key, 32 bytes against
+  * 48 for Node. link[0] is the left child and link[1] the right one, so
+  * mirror-image cases share code. 'refs' counts the links and tree roots
+  * pointing to the node, which is more than one once clones share it.
+  **/
+struct LeanNode {
+  struct LeanNode *link[2];
+  void *data;
+  NodeColor color;
+  uint32_t refs;
+};
+
+/**
+  * Red-black tree without parent pointers. Insert and remove record the
+  * search path on a fixed-size stack and rebalance along it, so rotations
+  * only rewrite the two child links involved.
+  *
+  * Without parent links a node can be shared by several trees. A tree that
+  * has been cloned copies each shared node it is about to modify, so a
+  * write copies O(log n) nodes. Those copies are taken from 'spare', a list
+  * of 'spares' nodes filled up before the write starts, so that running out
+  * of memory never leaves a half-rebalanced tree.
+  **/
+struct BTreeLean {
+  struct LeanNode *root;
+  size_t size;
+  int (*cmp)(void *, void *);
+  bool shared;
+  struct LeanNode *spare;
+  int spares;
+};
+
+/**
+  * In-order cursor holding the path to the current element. Any insert or
+  * remove invalidates the cursors of the tree.
+  **/
+struct BTreeLeanCursor {
+  struct LeanNode *stack[BTREE_LEAN_MAX_HEIGHT];
+  int depth;
+};
+
+typedef struct LeanNode LeanNode;
+typedef struct BTreeLean BTreeLean;
+typedef struct BTreeLeanCursor BTreeLeanCursor;
+
+BTreeLean* btree_lean_create(int (*cmp) (void *, void *));
+
+/**
+  * Builds a lean tree holding the elements of 'tree' in O(n) time and without
+  * comparisons; the two trees are independent afterwards. This is how a BTree
+  * is forked: convert it once and take btree_lean_clone copies of the result.
+  * Returns NULL if memory runs out and for trees without a compare function,
+  * i.e. those made by btree_create_keyed. Augmented values are not kept.
+  **/
+BTreeLean* btree_lean_from(BTree *tree);
+
+/**
+  * Returns a logically independent copy of the tree in constant time. The
+  * trees share their nodes, and each copies only the nodes on the paths it
+  * modifies. Clones may be used by different threads, each tree by one at a
+  * time. Returns NULL if memory runs out.
+  **/
+BTreeLean* btree_lean_clone(BTreeLean *tree);
+
+/**
+  * Inserts 'data'. Returns false if an equal element is present or the tree
+  * is out of memory, which leaves it unchanged.
+  **/
+bool btree_lean_insert(BTreeLean *tree, void *data);
+
+/**
+  * Returns the stored element equal to 'data', or NULL.
+  **/
+void* btree_lean_find(BTreeLean *tree, void *data);
+
+bool btree_lean_member(BTreeLean *tree, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none and
+  * if a tree that shares nodes runs out of memory for the copies it needs;
+  * either way the tree is unchanged.
+  **/
+bool btree_lean_remove(BTreeLean *tree, void *data);
+
+/**
+  * Positions 'cursor' at the smallest element and returns it, or NULL if the
+  * tree is empty.
+  **/
+void* btree_lean_first(BTreeLean *tree, BTreeLeanCursor *cursor);
+
+/**
+  * Advances 'cursor' and returns the element it reaches, or NULL past the
+  * largest one.
+  **/
+void* btree_lean_next(BTreeLeanCursor *cursor);
+
+void btree_lean_destroy(BTreeLean *tree);
+
+#endif  // BTREE_LEAN
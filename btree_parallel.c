@@ -0,0 +1,664 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btree_parallel.h"
+
+struct Task {
+  void* (*run)(void *arg);
+  void *arg;
+};
+
+/*
+ * Runs every task on its own thread and waits for all of them. A task whose
+ * thread cannot be created runs on the calling thread instead.
+ */
+static void run_tasks(struct Task *tasks, int n)
+{
+  pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * n);
+  bool *spawned = (bool*)calloc(n, sizeof(bool));
+  for (int i = 1; i < n; ++i) {
+    if (tids != NULL && spawned != NULL)
+      spawned[i] = pthread_create(&tids[i], NULL, tasks[i].run, tasks[i].arg) == 0;
+    if (spawned == NULL || !spawned[i])
+      tasks[i].run(tasks[i].arg);
+  }
+  if (n > 0)
+    tasks[0].run(tasks[0].arg);
+  for (int i = 1; i < n; ++i) {
+    if (spawned != NULL && spawned[i])
+      pthread_join(tids[i], NULL);
+  }
+  free(spawned);
+  free(tids);
+}
+
+struct SortJob {
+  int (*cmp)(void *, void *);
+  void **a;
+  void **tmp;
+  size_t lo;
+  size_t mid;
+  size_t hi;
+  int part;
+  int parts;
+};
+
+/* Stable merge of a[i, i_end) and a[j, j_end) into dst. */
+static void merge(int (*cmp)(void *, void *), void **a, size_t i, size_t i_end, size_t j,
+    size_t j_end, void **dst)
+{
+  size_t k = 0;
+  while (i < i_end && j < j_end)
+    dst[k++] = (cmp(a[j], a[i]) < 0)? a[j++] : a[i++];
+  while (i < i_end)
+    dst[k++] = a[i++];
+  while (j < j_end)
+    dst[k++] = a[j++];
+}
+
+/* Sorts a[lo, hi) in place, using tmp[lo, hi) as scratch space. */
+static void merge_sort(int (*cmp)(void *, void *), void **a, void **tmp, size_t lo, size_t hi)
+{
+  if (hi - lo < 2)
+    return;
+  size_t mid = lo + (hi - lo) / 2;
+  merge_sort(cmp, a, tmp, lo, mid);
+  merge_sort(cmp, a, tmp, mid, hi);
+  merge(cmp, a, lo, mid, mid, hi, tmp + lo);
+  memcpy(a + lo, tmp + lo, sizeof(void*) * (hi - lo));
+}
+
+static void* sort_chunk(void *arg)
+{
+  SortJob *job = (SortJob*)arg;
+  merge_sort(job->cmp, job->a, job->tmp, job->lo, job->hi);
+  return NULL;
+}
+
+/*
+ * Co-rank of output position 't' in the stable merge of a[lo, mid) and
+ * a[mid, hi): the number of elements the first t outputs take from the
+ * left run. Found by binary search, so merge parts start independently.
+ */
+static size_t co_rank(int (*cmp)(void *, void *), void **a, size_t lo, size_t mid, size_t hi,
+    size_t t)
+{
+  size_t left = mid - lo;
+  size_t right = hi - mid;
+  size_t i_lo = (t > right)? t - right : 0;
+  size_t i_hi = (t < left)? t : left;
+  while (i_lo < i_hi) {
+    size_t i = i_lo + (i_hi - i_lo) / 2;
+    size_t j = t - i;
+    // Too few from the left run if its next element goes before the last
+    // one taken from the right run; ties go to the left run.
+    if (j > 0 && i < left && cmp(a[mid + j - 1], a[lo + i]) >= 0)
+      i_lo = i + 1;
+    else
+      i_hi = i;
+  }
+  return i_lo;
+}
+
+/* Merges part 'part' of 'parts' equal slices of the output of one merge. */
+static void* merge_part(void *arg)
+{
+  SortJob *job = (SortJob*)arg;
+  size_t len = job->hi - job->lo;
+  size_t t0 = len * job->part / job->parts;
+  size_t t1 = len * (job->part + 1) / job->parts;
+  size_t i0 = co_rank(job->cmp, job->a, job->lo, job->mid, job->hi, t0);
+  size_t i1 = co_rank(job->cmp, job->a, job->lo, job->mid, job->hi, t1);
+  merge(job->cmp, job->a, job->lo + i0, job->lo + i1, job->mid + t0 - i0, job->mid + t1 - i1,
+        job->tmp + job->lo + t0);
+  return NULL;
+}
+
+/*
+ * Sorts 'a' with 'threads' sorted chunks merged pairwise in rounds. Every
+ * round keeps all threads busy: each merge is cut at co-ranks into as many
+ * parts as there are threads per merge, down to one merge of 'threads'
+ * parts in the last round.
+ */
+static void parallel_sort(int (*cmp)(void *, void *), void **a, void **tmp, size_t n, int threads)
+{
+  void **sorted = a;
+  SortJob *jobs = (SortJob*)malloc(sizeof(SortJob) * threads);
+  struct Task *tasks = (struct Task*)malloc(sizeof(struct Task) * threads);
+  if (jobs == NULL || tasks == NULL) {
+    free(tasks);
+    free(jobs);
+    merge_sort(cmp, a, tmp, 0, n);
+    return;
+  }
+  for (int i = 0; i < threads; ++i) {
+    SortJob job = {cmp, a, tmp, n * i / threads, 0, n * (i + 1) / threads, 0, 1};
+    jobs[i] = job;
+    tasks[i].run = sort_chunk;
+    tasks[i].arg = &jobs[i];
+  }
+  run_tasks(tasks, threads);
+  for (int width = 1; width < threads; width *= 2) {
+    int merges = (threads + 2 * width - 1) / (2 * width);
+    int parts = threads / merges;
+    int count = 0;
+    for (int i = 0; i < threads; i += 2 * width) {
+      size_t lo = n * i / threads;
+      size_t mid = n * ((i + width < threads)? i + width : threads) / threads;
+      size_t hi = n * ((i + 2 * width < threads)? i + 2 * width : threads) / threads;
+      for (int part = 0; part < parts; ++part) {
+        SortJob job = {cmp, a, tmp, lo, mid, hi, part, parts};
+        jobs[count] = job;
+        tasks[count].run = merge_part;
+        tasks[count].arg = &jobs[count];
+        count += 1;
+      }
+    }
+    run_tasks(tasks, count);
+    void **swap = a;
+    a = tmp;
+    tmp = swap;
+  }
+  if (a != sorted)
+    memcpy(sorted, a, sizeof(void*) * n);
+  free(tasks);
+  free(jobs);
+}
+
+struct BuildJob {
+  BTree *tree;
+  void **items;
+  size_t lo;
+  size_t hi;
+  int depth;
+  int red_depth;
+  int spawn_depth;
+  Node *parent;
+  Node *root;
+  bool failed;
+};
+
+static void* build_subtree(void *arg);
+
+/*
+ * Links items[lo, hi) into a subtree rooted at the middle element. Halves
+ * differ in size by at most one, so every level but the deepest is full;
+ * nodes on that level ('red_depth') are red and all others black, which
+ * gives every path the same number of black nodes. Threads take nodes
+ * from the tree's allocator concurrently, which is malloc for the tree
+ * btree_build_parallel creates.
+ */
+static Node* build_helper(BuildJob *job, size_t lo, size_t hi, int depth, Node *parent)
+{
+  if (lo >= hi)
+    return NULL;
+  size_t mid = lo + (hi - lo) / 2;
+  Node *n = btree_node_alloc(job->tree);
+  if (n == NULL) {
+    job->failed = true;
+    return NULL;
+  }
+  n->data = job->items[mid];
+  n->key.u64 = 0;
+  n->hits = 0;
+  n->parent = parent;
+  n->color = (depth == job->red_depth)? BTREE_RED : BTREE_BLACK;
+  if (depth < job->spawn_depth) {
+    BuildJob right = {job->tree, job->items, mid + 1, hi, depth + 1, job->red_depth, job->spawn_depth, n, NULL, false};
+    pthread_t tid;
+    bool spawned = pthread_create(&tid, NULL, build_subtree, &right) == 0;
+    if (!spawned)
+      build_subtree(&right);
+    n->left = build_helper(job, lo, mid, depth + 1, n);
+    if (spawned)
+      pthread_join(tid, NULL);
+    n->right = right.root;
+    job->failed = job->failed || right.failed;
+  } else {
+    n->left = build_helper(job, lo, mid, depth + 1, n);
+    n->right = build_helper(job, mid + 1, hi, depth + 1, n);
+  }
+  return n;
+}
+
+static void* build_subtree(void *arg)
+{
+  BuildJob *job = (BuildJob*)arg;
+  job->root = build_helper(job, job->lo, job->hi, job->depth, job->parent);
+  return NULL;
+}
+
+static int floor_log2(size_t x)
+{
+  int r = 0;
+  while (x >>= 1)
+    r += 1;
+  return r;
+}
+
+static int ceil_log2(size_t x)
+{
+  return (x <= 1)? 0 : floor_log2(x - 1) + 1;
+}
+
+BTree* btree_build_parallel(int (*cmp) (void *, void *), void **items, size_t n, int threads)
+{
+  BTree *tree = btree_create(cmp);
+  if (tree == NULL || n == 0)
+    return tree;
+  if (threads < 1)
+    threads = 1;
+  void **a = (void**)malloc(sizeof(void*) * n);
+  void **tmp = (void**)malloc(sizeof(void*) * n);
+  if (a == NULL || tmp == NULL) {
+    free(a);
+    free(tmp);
+    btree_destroy(tree);
+    return NULL;
+  }
+  memcpy(a, items, sizeof(void*) * n);
+  parallel_sort(cmp, a, tmp, n, threads);
+  free(tmp);
+
+  size_t m = 1;
+  for (size_t i = 1; i < n; ++i) {
+    if (cmp(a[i], a[m - 1]) != 0)
+      a[m++] = a[i];
+  }
+
+  BuildJob job = {tree, a, 0, m, 0, floor_log2(m + 1), ceil_log2(threads), NULL, NULL, false};
+  build_subtree(&job);
+  free(a);
+  tree->root = job.root;
+  if (job.failed) {
+    btree_destroy(tree);
+    return NULL;
+  }
+  tree->root->color = BTREE_BLACK;
+  tree->size = m;
+  tree->black_height = job.red_depth;
+  tree->first = tree->root;
+  while (tree->first->left != NULL)
+    tree->first = tree->first->left;
+  tree->last = tree->root;
+  while (tree->last->right != NULL)
+    tree->last = tree->last->right;
+  return tree;
+}
+
+static void collect_chunks(Node *n, int depth, int cut, BTreeIterator *bounds, size_t *count)
+{
+  if (n == NULL)
+    return;
+  if (depth == cut) {
+    bounds[(*count)++].node = n;
+    return;
+  }
+  collect_chunks(n->left, depth + 1, cut, bounds, count);
+  collect_chunks(n->right, depth + 1, cut, bounds, count);
+}
+
+/* A subtree that splits into two chunks: its root joins the left one. */
+static bool splittable(Node *n)
+{
+  return n->left != NULL && n->right != NULL;
+}
+
+size_t btree_split_chunks(BTree *tree, BTreeIterator *bounds, size_t max)
+{
+  if (tree->root == NULL || max == 0)
+    return 0;
+  // bounds[i].node holds the root of chunk i's subtree until the end.
+  size_t count = 0;
+  collect_chunks(tree->root, 0, floor_log2(max), bounds, &count);
+  if (count == 0)
+    bounds[count++].node = tree->root;
+  // Fill the remaining slots a level at a time: each pass splits the
+  // subtrees in order, and a pass only stops early once 'max' is reached,
+  // so a split never leaves a larger subtree whole.
+  while (count < max) {
+    size_t splits = 0, limit = 0;
+    for (; limit < count && splits < max - count; ++limit)
+      splits += splittable(bounds[limit].node);
+    if (splits == 0)
+      break;
+    size_t j = count + splits;
+    for (size_t i = count; i-- > 0;) {
+      Node *n = bounds[i].node;
+      if (i < limit && splittable(n)) {
+        bounds[--j].node = n->right;
+        bounds[--j].node = n->left;
+      } else {
+        bounds[--j].node = n;
+      }
+    }
+    count += splits;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Node *n = bounds[i].node;
+    while (n->left != NULL)
+      n = n->left;
+    bounds[i].tree = tree;
+    bounds[i].node = n;
+  }
+  // Elements on the leftmost path above the subtrees join the first chunk.
+  bounds[0].node = tree->first;
+  return count;
+}
+
+/* No red-black tree addressable with 64-bit pointers is deeper than this. */
+#define MAX_HEIGHT 128
+
+/*
+ * A piece of a key range: the whole subtree at 'n', or 'n' alone. Chunks
+ * start at whole pieces; a lone node joins the chunk before it.
+ */
+struct RangePiece {
+  Node *n;
+  int depth;
+  bool whole;
+};
+
+/* Returns true if node 'a' comes before node 'b'; a NULL 'b' is past the end. */
+static bool node_before(BTree *tree, Node *a, Node *b)
+{
+  return b == NULL || btree_compare(tree, a->data, b) < 0;
+}
+
+/*
+ * Appends the pieces of [start, end) under 'n' in order. 'lo_in' and
+ * 'hi_in' tell whether the subtree is known to lie above 'start' and below
+ * 'end'; only the two boundary paths are descended, so this yields
+ * O(log n) pieces.
+ */
+static void decompose(BTree *tree, Node *n, int depth, bool lo_in, bool hi_in, Node *start,
+                      Node *end, RangePiece *out, size_t *count)
+{
+  if (n == NULL)
+    return;
+  if (lo_in && hi_in) {
+    RangePiece p = {n, depth, true};
+    out[(*count)++] = p;
+  } else if (!lo_in && node_before(tree, n, start)) {
+    decompose(tree, n->right, depth + 1, lo_in, hi_in, start, end, out, count);
+  } else if (!hi_in && !node_before(tree, n, end)) {
+    decompose(tree, n->left, depth + 1, lo_in, hi_in, start, end, out, count);
+  } else {
+    decompose(tree, n->left, depth + 1, lo_in, true, start, end, out, count);
+    RangePiece p = {n, depth, false};
+    out[(*count)++] = p;
+    decompose(tree, n->right, depth + 1, true, hi_in, start, end, out, count);
+  }
+}
+
+/*
+ * Chunks the pieces make: the first chunk starts at the range's first
+ * element, whatever pieces[0] is, and every later whole piece starts one.
+ */
+static size_t range_chunks(RangePiece *pieces, size_t count)
+{
+  size_t chunks = 1;
+  for (size_t i = 1; i < count; ++i)
+    chunks += pieces[i].whole;
+  return chunks;
+}
+
+size_t btree_split_range(BTree *tree, void *lo, void *hi, BTreeIterator *bounds, size_t max)
+{
+  Node *start = (lo == NULL)? tree->first : btree_lower_bound(tree, lo).node;
+  Node *end = (hi == NULL)? NULL : btree_lower_bound(tree, hi).node;
+  if (max == 0 || start == NULL || !node_before(tree, start, end))
+    return 0;
+  // The boundary paths give at most three pieces per level; every split
+  // below adds at most two more.
+  size_t cap = 6 * MAX_HEIGHT + 3 * max;
+  RangePiece *pieces = (RangePiece*)malloc(sizeof(RangePiece) * cap);
+  if (pieces == NULL) {
+    bounds[0].tree = tree;
+    bounds[0].node = start;
+    return 1;
+  }
+  size_t count = 0;
+  decompose(tree, tree->root, 0, lo == NULL, hi == NULL, start, end, pieces, &count);
+
+  // Split the shallowest, i.e. presumably largest, subtree until there are
+  // enough chunks or no room for another split.
+  while (count + 2 <= cap && range_chunks(pieces, count) < max) {
+    size_t best = count;
+    for (size_t i = 0; i < count; ++i) {
+      Node *n = pieces[i].n;
+      if (pieces[i].whole && (n->left != NULL || n->right != NULL) &&
+          (best == count || pieces[i].depth < pieces[best].depth))
+        best = i;
+    }
+    if (best == count)
+      break;
+    RangePiece p = pieces[best];
+    RangePiece split[3];
+    int k = 0;
+    if (p.n->left != NULL) {
+      RangePiece l = {p.n->left, p.depth + 1, true};
+      split[k++] = l;
+    }
+    RangePiece mid = {p.n, p.depth, false};
+    split[k++] = mid;
+    if (p.n->right != NULL) {
+      RangePiece r = {p.n->right, p.depth + 1, true};
+      split[k++] = r;
+    }
+    memmove(pieces + best + k, pieces + best + 1, sizeof(RangePiece) * (count - best - 1));
+    memcpy(pieces + best, split, sizeof(RangePiece) * k);
+    count += k - 1;
+  }
+  // Too many pieces from the boundary paths alone: fold the smallest
+  // subtrees into the chunks before them. Past the first chunk there is
+  // a whole piece for each chunk, so one is always found.
+  for (size_t chunks = range_chunks(pieces, count); chunks > max; --chunks) {
+    size_t worst = count;
+    for (size_t i = 1; i < count; ++i) {
+      if (pieces[i].whole && (worst == count || pieces[i].depth > pieces[worst].depth))
+        worst = i;
+    }
+    pieces[worst].whole = false;
+  }
+
+  size_t n = 0;
+  bounds[n].tree = tree;
+  bounds[n++].node = start;
+  for (size_t i = 1; i < count; ++i) {
+    if (!pieces[i].whole)
+      continue;
+    Node *first = pieces[i].n;
+    while (first->left != NULL)
+      first = first->left;
+    bounds[n].tree = tree;
+    bounds[n++].node = first;
+  }
+  free(pieces);
+  return n;
+}
+
+/* In-order successor; btree_next is not used so that the walk skips heat counting. */
+static Node* next_node(Node *n)
+{
+  if (n->right != NULL) {
+    n = n->right;
+    while (n->left != NULL)
+      n = n->left;
+    return n;
+  }
+  while (n->parent != NULL && n->parent->right == n)
+    n = n->parent;
+  return n->parent;
+}
+
+struct ForeachJob {
+  BTreeIterator *bounds;
+  size_t nchunks;
+  size_t next_chunk;
+  void (*fn)(void *data, void *arg);
+  void *arg;
+};
+
+static void* foreach_worker(void *arg)
+{
+  ForeachJob *job = (ForeachJob*)arg;
+  for (;;) {
+    size_t i = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (i >= job->nchunks)
+      return NULL;
+    Node *end = (i + 1 < job->nchunks)? job->bounds[i + 1].node : NULL;
+    for (Node *n = job->bounds[i].node; n != end; n = next_node(n))
+      job->fn(n->data, job->arg);
+  }
+}
+
+bool btree_parallel_foreach(BTree *tree, void (*fn)(void *data, void *arg), void *arg, int threads)
+{
+  if (threads < 1)
+    threads = 1;
+  size_t max = BTREE_CHUNKS_PER_THREAD * (size_t)threads;
+  BTreeIterator *bounds = (BTreeIterator*)malloc(sizeof(BTreeIterator) * max);
+  struct Task *tasks = (struct Task*)malloc(sizeof(struct Task) * threads);
+  if (bounds == NULL || tasks == NULL) {
+    free(bounds);
+    free(tasks);
+    return false;
+  }
+  ForeachJob job = {bounds, btree_split_chunks(tree, bounds, max), 0, fn, arg};
+  for (int i = 0; i < threads; ++i) {
+    tasks[i].run = foreach_worker;
+    tasks[i].arg = &job;
+  }
+  run_tasks(tasks, threads);
+  free(tasks);
+  free(bounds);
+  return true;
+}
+
+/* A chunk of btree_reduce, from 'start' up to but not including 'end'. */
+struct ReduceChunk {
+  Node *start;
+  Node *end;
+  int64_t result;
+};
+
+/*
+ * Worker state for btree_reduce. 'range' packs the worker's unclaimed chunk
+ * indices [lo, hi) as lo << 32 | hi: the owner claims chunks from the front
+ * and idle workers steal from the back, both with a CAS on the same word.
+ */
+struct ReduceWorker {
+  uint64_t range;
+  struct ReduceJob *job;
+} __attribute__((aligned(BTREE_CACHE_LINE)));
+
+struct ReduceJob {
+  BTree *tree;
+  ReduceChunk *chunks;
+  ReduceWorker *workers;
+  int nworkers;
+  int64_t (*map)(void *data, void *arg);
+  int64_t (*combine)(int64_t a, int64_t b);
+  int64_t identity;
+  void *arg;
+};
+
+/* Claims one chunk of 'w', from the front if 'own', else from the back; -1 if none. */
+static int64_t claim_chunk(ReduceWorker *w, bool own)
+{
+  uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint64_t lo = range >> 32;
+    uint64_t hi = range & 0xffffffff;
+    if (lo >= hi)
+      return -1;
+    uint64_t next = own? ((lo + 1) << 32 | hi) : (lo << 32 | (hi - 1));
+    if (__atomic_compare_exchange_n(&w->range, &range, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return own? (int64_t)lo : (int64_t)(hi - 1);
+  }
+}
+
+static void reduce_chunk(ReduceJob *job, ReduceChunk *c)
+{
+  int64_t acc = job->identity;
+  for (Node *n = c->start; n != c->end; n = next_node(n))
+    acc = job->combine(acc, job->map(n->data, job->arg));
+  c->result = acc;
+}
+
+static void* reduce_worker(void *arg)
+{
+  ReduceWorker *w = (ReduceWorker*)arg;
+  ReduceJob *job = w->job;
+  int self = (int)(w - job->workers);
+  int64_t i;
+  while ((i = claim_chunk(w, true)) >= 0)
+    reduce_chunk(job, &job->chunks[i]);
+  for (int k = 1; k < job->nworkers; ++k) {
+    ReduceWorker *victim = &job->workers[(self + k) % job->nworkers];
+    while ((i = claim_chunk(victim, false)) >= 0)
+      reduce_chunk(job, &job->chunks[i]);
+  }
+  return NULL;
+}
+
+int64_t btree_reduce(BTree *tree, void *lo, void *hi, int64_t (*map)(void *data, void *arg),
+                     int64_t (*combine)(int64_t a, int64_t b), int64_t identity, void *arg,
+                     int threads)
+{
+  if (threads < 1)
+    threads = 1;
+  Node *start = (lo == NULL)? tree->first : btree_lower_bound(tree, lo).node;
+  Node *end = (hi == NULL)? NULL : btree_lower_bound(tree, hi).node;
+  if (start == NULL || !node_before(tree, start, end))
+    return identity;
+
+  size_t max = BTREE_CHUNKS_PER_THREAD * (size_t)threads;
+  BTreeIterator *bounds = (BTreeIterator*)malloc(sizeof(BTreeIterator) * max);
+  ReduceChunk *chunks = (ReduceChunk*)malloc(sizeof(ReduceChunk) * max);
+  void *aligned = NULL;
+  if (posix_memalign(&aligned, BTREE_CACHE_LINE, sizeof(ReduceWorker) * threads) != 0)
+    aligned = NULL;
+  ReduceWorker *workers = (ReduceWorker*)aligned;
+  struct Task *tasks = (struct Task*)malloc(sizeof(struct Task) * threads);
+  if (bounds == NULL || chunks == NULL || workers == NULL || tasks == NULL) {
+    // Fall back to a serial pass rather than fail.
+    free(bounds);
+    free(chunks);
+    free(workers);
+    free(tasks);
+    ReduceChunk c = {start, end, identity};
+    ReduceJob job = {tree, &c, NULL, 0, map, combine, identity, arg};
+    reduce_chunk(&job, &c);
+    return c.result;
+  }
+
+  size_t n = btree_split_range(tree, lo, hi, bounds, max);
+  for (size_t i = 0; i < n; ++i) {
+    chunks[i].start = bounds[i].node;
+    chunks[i].end = (i + 1 < n)? bounds[i + 1].node : end;
+    chunks[i].result = identity;
+  }
+
+  ReduceJob job = {tree, chunks, workers, threads, map, combine, identity, arg};
+  for (int t = 0; t < threads; ++t) {
+    uint64_t first = n * t / threads;
+    uint64_t last = n * (t + 1) / threads;
+    workers[t].range = first << 32 | last;
+    workers[t].job = &job;
+    tasks[t].run = reduce_worker;
+    tasks[t].arg = &workers[t];
+  }
+  run_tasks(tasks, threads);
+
+  int64_t res = identity;
+  for (size_t i = 0; i < n; ++i)
+    res = combine(res, chunks[i].result);
+  free(tasks);
+  free(workers);
+  free(chunks);
+  free(bounds);
+  return res;
+}
@@ -0,0 +1,61 @@
+#ifndef BTREE_PARALLEL
+#define BTREE_PARALLEL
+
+#include "btree.h"
+
+/**
+  * Builds a tree from 'n' unsorted pointers using up to 'threads' threads.
+  * The input is merge-sorted in parallel; every merge round, the last one
+  * over all n elements included, is split among all threads. Of equal
+  * elements only the first in 'items' is kept, as if they had been inserted
+  * in order; that pass over the sorted input is serial. The balanced tree is
+  * then built bottom-up, with subtrees linked concurrently. Returns NULL if
+  * memory runs out.
+  **/
+BTree* btree_build_parallel(int (*cmp) (void *, void *), void **items, size_t n, int threads);
+
+/* Chunks btree_parallel_foreach cuts per thread, to even out their sizes. */
+#define BTREE_CHUNKS_PER_THREAD 8
+
+/**
+  * Splits the tree into at most 'max' in-order chunks at subtree
+  * boundaries and returns their number. Chunk i runs from bounds[i] up to,
+  * but not including, bounds[i + 1]; the last one runs to the end. The
+  * chunks are the subtrees at depth floor(log2(max)), the first of which
+  * are split into their two children until there are 'max' chunks or every
+  * subtree is too small, so their sizes vary with the balance of the tree.
+  * Costs O(max log n).
+  **/
+size_t btree_split_chunks(BTree *tree, BTreeIterator *bounds, size_t max);
+
+/**
+  * Like btree_split_chunks, but splits only the elements in [lo, hi); a NULL
+  * bound leaves that side open. The chunks are cut from the subtrees between
+  * the search paths of the two bounds, largest first, so a small range still
+  * yields about 'max' chunks; the last one runs up to btree_lower_bound(hi).
+  * Returns 0 for an empty range. Costs O(max^2 + log n) time.
+  **/
+size_t btree_split_range(BTree *tree, void *lo, void *hi, BTreeIterator *bounds, size_t max);
+
+/**
+  * Calls fn(data, arg) on every element from 'threads' threads. Each chunk
+  * of btree_split_chunks is visited in order by one thread, and idle threads
+  * take the next unvisited chunk. 'fn' must be thread-safe, and the tree must
+  * not be modified meanwhile. Returns false if memory runs out.
+  **/
+bool btree_parallel_foreach(BTree *tree, void (*fn)(void *data, void *arg), void *arg, int threads);
+
+/**
+  * Folds map(data, arg) over the elements in [lo, hi) with 'combine',
+  * starting from 'identity'; a NULL bound leaves that side open. The range
+  * is cut with btree_split_range and the chunks are reduced by 'threads'
+  * workers that steal chunks from each other when idle. Partial results are
+  * combined in key order, so 'combine' needs to be associative but not
+  * commutative. 'map' and 'combine' must be thread-safe, and the tree must
+  * not be modified meanwhile.
+  **/
+int64_t btree_reduce(BTree *tree, void *lo, void *hi, int64_t (*map)(void *data, void *arg),
+                     int64_t (*combine)(int64_t a, int64_t b), int64_t identity, void *arg,
+                     int threads);
+
+#endif  // BTREE_PARALLEL
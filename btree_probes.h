@@ -0,0 +1,25 @@
+#ifndef BTREE_PROBES
+#define BTREE_PROBES
+
+/*
+ * Static tracepoints in the "btree" provider. Built with -DBTREE_USDT
+ * (make USDT=1) they become USDT probes from <sys/sdt.h>, visible to
+ * perf, bpftrace and SystemTap as usdt:<binary>:btree:<name>; each costs a
+ * single nop until a tracer attaches. Otherwise they compile to nothing.
+ *
+ *   rotate_left(tree, node), rotate_right(tree, node)
+ *       'node' is the subtree root before the rotation.
+ *   insert_recolor(tree, node)
+ *       insert fixup pushed a red violation up to the grandparent 'node'.
+ *   remove_fixup(tree, node)
+ *       one step of the remove fixup at the parent 'node' of the deficit.
+ *   node_alloc(tree, node), node_free(tree, node)
+ */
+#ifdef BTREE_USDT
+#include <sys/sdt.h>
+#define BTREE_PROBE2(name, a, b) DTRACE_PROBE2(btree, name, a, b)
+#else
+#define BTREE_PROBE2(name, a, b) do {} while (0)
+#endif
+
+#endif  // BTREE_PROBES
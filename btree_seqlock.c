@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "btree_seqlock.h"
+
+/* No red-black tree addressable with 64-bit pointers is deeper than this. */
+#define MAX_DESCENT 128
+
+#define LOAD(ptr) __atomic_load_n(&(ptr), __ATOMIC_RELAXED)
+
+static void* seq_node_alloc(void *ctx, size_t size)
+{
+  BTreeSeq *st = (BTreeSeq*)ctx;
+  Node *n = st->free_nodes;
+  if (n == NULL)
+    return malloc(size);
+  st->free_nodes = n->parent;
+  return n;
+}
+
+static void seq_node_free(void *ctx, void *ptr)
+{
+  BTreeSeq *st = (BTreeSeq*)ctx;
+  Node *n = (Node*)ptr;
+  n->parent = st->free_nodes;
+  st->free_nodes = n;
+}
+
+BTreeSeq* btree_seq_create(BTree *tree)
+{
+  BTreeSeq *st = (BTreeSeq*)malloc(sizeof(BTreeSeq));
+  if (st == NULL)
+    return NULL;
+  st->tree = tree;
+  st->seq = 0;
+  st->free_nodes = NULL;
+  pthread_mutex_init(&st->writer, NULL);
+  BTreeAllocator allocator = {seq_node_alloc, seq_node_free, NULL, st, NULL};
+  btree_set_allocator(tree, allocator);
+  return st;
+}
+
+static void write_begin(BTreeSeq *st)
+{
+  pthread_mutex_lock(&st->writer);
+  __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(BTreeSeq *st)
+{
+  __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&st->writer);
+}
+
+bool btree_seq_insert(BTreeSeq *st, void *data)
+{
+  write_begin(st);
+  bool res = btree_insert(st->tree, data);
+  write_end(st);
+  return res;
+}
+
+bool btree_seq_remove(BTreeSeq *st, void *data)
+{
+  write_begin(st);
+  BTreeIterator it = btree_find(st->tree, data);
+  btree_remove(it);
+  write_end(st);
+  return it.node != NULL;
+}
+
+void* btree_seq_find(BTreeSeq *st, void *data)
+{
+  for (;;) {
+    unsigned seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    Node *node = LOAD(st->tree->root);
+    void *found = NULL;
+    for (int depth = 0; node != NULL && depth < MAX_DESCENT; ++depth) {
+      int cmp_result = btree_compare(st->tree, data, node);
+      if (cmp_result == 0) {
+        found = LOAD(node->data);
+        break;
+      }
+      node = (cmp_result < 0)? LOAD(node->left) : LOAD(node->right);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) == seq)
+      return found;
+  }
+}
+
+void btree_seq_destroy(BTreeSeq *st)
+{
+  btree_destroy(st->tree);
+  while (st->free_nodes != NULL) {
+    Node *n = st->free_nodes;
+    st->free_nodes = n->parent;
+    free(n);
+  }
+  pthread_mutex_destroy(&st->writer);
+  free(st);
+}
@@ -0,0 +1,47 @@
+#ifndef BTREE_SEQLOCK
+#define BTREE_SEQLOCK
+
+#include <pthread.h>
+
+#include "btree.h"
+
+/**
+  * A tree whose lookups take no lock. Writers are serialized by a mutex and
+  * make 'seq' odd for the duration of an insert or remove; a reader descends
+  * without synchronization and retries if 'seq' changed meanwhile.
+  *
+  * Removed nodes are kept on 'free_nodes' and reused by later inserts rather
+  * than returned to malloc, so a reader racing with a writer only ever
+  * follows pointers to node memory. With a compare function, readers may
+  * still call it on an element removed concurrently; such elements must stay
+  * readable (or use an inline-key tree, see btree_create_keyed).
+  **/
+struct BTreeSeq {
+  BTree *tree;
+  unsigned seq;
+  pthread_mutex_t writer;
+  Node *free_nodes;
+};
+
+typedef struct BTreeSeq BTreeSeq;
+
+/**
+  * Wraps the empty tree 'tree'; the wrapper owns it from now on.
+  **/
+BTreeSeq* btree_seq_create(BTree *tree);
+
+bool btree_seq_insert(BTreeSeq *st, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none.
+  **/
+bool btree_seq_remove(BTreeSeq *st, void *data);
+
+/**
+  * Returns the stored element equal to 'data', or NULL. Never blocks writers.
+  **/
+void* btree_seq_find(BTreeSeq *st, void *data);
+
+void btree_seq_destroy(BTreeSeq *st);
+
+#endif  // BTREE_SEQLOCK
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "btree_sharded.h"
+
+#define SKEW_CHECK_INTERVAL 1024
+#define SKEW_MIN_SHARD_SIZE 64
+
+BTreeSharded* btree_sharded_create(int (*cmp) (void *, void *), int nshards, void **bounds)
+{
+  BTreeSharded *st = (BTreeSharded*)malloc(sizeof(BTreeSharded));
+  if (st == NULL)
+    return NULL;
+  void *shards = NULL;
+  if (posix_memalign(&shards, BTREE_CACHE_LINE, sizeof(BTreeShard) * nshards) != 0) {
+    free(st);
+    return NULL;
+  }
+  st->shards = (BTreeShard*)shards;
+  st->bounds = (void**)malloc(sizeof(void*) * nshards);
+  for (int i = 0; i < nshards; ++i) {
+    st->shards[i].tree = (st->bounds == NULL)? NULL : btree_create(cmp);
+    if (st->shards[i].tree == NULL) {
+      while (--i >= 0)
+        btree_destroy(st->shards[i].tree);
+      free(st->bounds);
+      free(st->shards);
+      free(st);
+      return NULL;
+    }
+  }
+  st->cmp = cmp;
+  st->nshards = nshards;
+  st->max_skew = 2.0;
+  st->rebalancing = 0;
+  pthread_rwlock_init(&st->routing, NULL);
+  for (int i = 0; i < nshards; ++i) {
+    pthread_mutex_init(&st->shards[i].lock, NULL);
+    st->shards[i].size = 0;
+    st->shards[i].version = 0;
+    if (i < nshards - 1)
+      st->bounds[i] = (bounds == NULL)? NULL : bounds[i];
+  }
+  return st;
+}
+
+/* Index of the shard owning 'data': the number of bounds not greater than it. */
+static int route(BTreeSharded *st, void *data)
+{
+  int lo = 0;
+  int hi = st->nshards - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    void *bound = st->bounds[mid];
+    if (bound != NULL && st->cmp(data, bound) >= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+size_t btree_sharded_size(BTreeSharded *st)
+{
+  size_t size = 0;
+  for (int i = 0; i < st->nshards; ++i)
+    size += __atomic_load_n(&st->shards[i].size, __ATOMIC_RELAXED);
+  return size;
+}
+
+/* Publishes a change to the shard's tree; called with the shard lock held. */
+static void shard_changed(BTreeShard *shard)
+{
+  shard->version += 1;
+  __atomic_store_n(&shard->size, shard->tree->size, __ATOMIC_RELAXED);
+}
+
+static bool is_skewed(BTreeSharded *st, size_t shard_size)
+{
+  if (shard_size % SKEW_CHECK_INTERVAL != 0 || shard_size < SKEW_MIN_SHARD_SIZE)
+    return false;
+  return shard_size > st->max_skew * btree_sharded_size(st) / st->nshards;
+}
+
+bool btree_sharded_insert(BTreeSharded *st, void *data)
+{
+  pthread_rwlock_rdlock(&st->routing);
+  BTreeShard *shard = &st->shards[route(st, data)];
+  pthread_mutex_lock(&shard->lock);
+  size_t shard_size = shard->tree->size;
+  bool res = btree_insert(shard->tree, data);
+  if (shard->tree->size != shard_size) {
+    shard_changed(shard);
+    shard_size += 1;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  pthread_rwlock_unlock(&st->routing);
+  if (is_skewed(st, shard_size) && __sync_bool_compare_and_swap(&st->rebalancing, 0, 1)) {
+    btree_sharded_rebalance(st);
+    __sync_lock_release(&st->rebalancing);
+  }
+  return res;
+}
+
+bool btree_sharded_member(BTreeSharded *st, void *data)
+{
+  pthread_rwlock_rdlock(&st->routing);
+  BTreeShard *shard = &st->shards[route(st, data)];
+  pthread_mutex_lock(&shard->lock);
+  bool res = btree_member(shard->tree, data);
+  pthread_mutex_unlock(&shard->lock);
+  pthread_rwlock_unlock(&st->routing);
+  return res;
+}
+
+/*
+ * Bounds that point to a removed element are replaced before the removal
+ * returns, since the client may free the element right after. The new
+ * bound is the shard's new smallest element, or the following bound if the
+ * shard became empty.
+ */
+static void replace_bound(BTreeSharded *st, int s, void *removed)
+{
+  pthread_rwlock_wrlock(&st->routing);
+  void *next = (s < st->nshards - 1)? st->bounds[s] : NULL;
+  if (!btree_isempty(st->shards[s].tree))
+    next = btree_first(st->shards[s].tree);
+  for (int i = s - 1; i >= 0 && st->bounds[i] == removed; --i)
+    st->bounds[i] = next;
+  pthread_rwlock_unlock(&st->routing);
+}
+
+bool btree_sharded_remove(BTreeSharded *st, void *data)
+{
+  pthread_rwlock_rdlock(&st->routing);
+  int s = route(st, data);
+  BTreeShard *shard = &st->shards[s];
+  pthread_mutex_lock(&shard->lock);
+  BTreeIterator it = btree_find(shard->tree, data);
+  void *removed = (it.node == NULL)? NULL : it.node->data;
+  btree_remove(it);
+  if (removed != NULL)
+    shard_changed(shard);
+  bool was_bound = removed != NULL && s > 0 && st->bounds[s - 1] == removed;
+  pthread_mutex_unlock(&shard->lock);
+  pthread_rwlock_unlock(&st->routing);
+  if (was_bound)
+    replace_bound(st, s, removed);
+  return removed != NULL;
+}
+
+void btree_sharded_foreach(BTreeSharded *st, void (*cb)(void *data, void *arg), void *arg)
+{
+  pthread_rwlock_rdlock(&st->routing);
+  for (int i = 0; i < st->nshards; ++i) {
+    BTreeShard *shard = &st->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    for (BTreeIterator it = btree_begin(shard->tree); it.node != NULL; it = btree_next(it))
+      cb(it.node->data, arg);
+    pthread_mutex_unlock(&shard->lock);
+  }
+  pthread_rwlock_unlock(&st->routing);
+}
+
+size_t btree_sharded_range(BTreeSharded *st, void *lo, void *hi,
+    void (*cb)(void *data, void *arg), void *arg)
+{
+  size_t visited = 0;
+  bool done = false;
+  pthread_rwlock_rdlock(&st->routing);
+  for (int i = route(st, lo); i < st->nshards && !done; ++i) {
+    BTreeShard *shard = &st->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    BTreeIterator it = (visited == 0)? btree_lower_bound(shard->tree, lo) : btree_begin(shard->tree);
+    for (; it.node != NULL; it = btree_next(it)) {
+      if (st->cmp(it.node->data, hi) > 0) {
+        done = true;
+        break;
+      }
+      cb(it.node->data, arg);
+      visited += 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  pthread_rwlock_unlock(&st->routing);
+  return visited;
+}
+
+/* Planning attempts made before a rebalance gives up. */
+#define REBALANCE_ATTEMPTS 3
+
+/* Number of elements shard 'i' holds after a rebalance. */
+static size_t target_size(size_t total, int n, int i)
+{
+  return total / n + ((size_t)i < total % n);
+}
+
+/* The element 'rank' places from the start of 'tree', walking from the nearer end. */
+static BTreeIterator nth(BTree *tree, size_t rank)
+{
+  if (rank < tree->size / 2) {
+    BTreeIterator it = btree_begin(tree);
+    for (size_t i = 0; i < rank; ++i)
+      it = btree_next(it);
+    return it;
+  }
+  BTreeIterator it = btree_rbegin(tree);
+  for (size_t i = rank + 1; i < tree->size; ++i)
+    it = btree_prev(it);
+  return it;
+}
+
+/*
+ * Finds cuts[i], the element that is to start shard i + 1 (a NULL node if
+ * that shard ends up empty), and records the version of every shard it
+ * looked at. Called with the routing lock shared; shards are locked one at
+ * a time, and the plan is dropped (false) if a shard changes between the
+ * two passes. Nodes keep no subtree sizes, so finding a cut walks up to
+ * half of its shard.
+ */
+static bool plan_cuts(BTreeSharded *st, unsigned long *versions, BTreeIterator *cuts)
+{
+  int n = st->nshards;
+  size_t total = 0;
+  for (int i = 0; i < n; ++i) {
+    BTreeShard *shard = &st->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    versions[i] = shard->version;
+    total += shard->tree->size;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  size_t offset = 0;
+  size_t rank = target_size(total, n, 0);
+  int j = 0;
+  for (int i = 0; i < n && j < n - 1; ++i) {
+    BTreeShard *shard = &st->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    bool same = shard->version == versions[i];
+    size_t size = shard->tree->size;
+    for (; same && j < n - 1 && rank < offset + size; ++j) {
+      cuts[j] = nth(shard->tree, rank - offset);
+      rank += target_size(total, n, j + 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!same)
+      return false;
+    offset += size;
+  }
+  for (; j < n - 1; ++j)
+    cuts[j].node = NULL;
+  return true;
+}
+
+/*
+ * Joins all shards into the first and splits the result at the planned
+ * cuts, from the last one down, so each split hands the tail to its shard.
+ * Called with the routing lock held exclusively.
+ */
+static void redistribute(BTreeSharded *st, BTreeIterator *cuts)
+{
+  int n = st->nshards;
+  BTree *all = st->shards[0].tree;
+  for (int i = 1; i < n; ++i)
+    btree_join(all, st->shards[i].tree);
+  size_t total = all->size;
+  for (int i = n - 2; i >= 0; --i) {
+    cuts[i].tree = all;
+    btree_split(cuts[i], target_size(total, n, i + 1), st->shards[i + 1].tree);
+    st->bounds[i] = (cuts[i].node == NULL)? NULL : cuts[i].node->data;
+  }
+  for (int i = 0; i < n; ++i)
+    shard_changed(&st->shards[i]);
+}
+
+bool btree_sharded_rebalance(BTreeSharded *st)
+{
+  int n = st->nshards;
+  unsigned long *versions = (unsigned long*)malloc(sizeof(unsigned long) * n);
+  BTreeIterator *cuts = (BTreeIterator*)malloc(sizeof(BTreeIterator) * n);
+  bool done = false;
+  for (int attempt = 0; attempt < REBALANCE_ATTEMPTS && versions != NULL && cuts != NULL &&
+       !done; ++attempt) {
+    pthread_rwlock_rdlock(&st->routing);
+    bool planned = plan_cuts(st, versions, cuts);
+    pthread_rwlock_unlock(&st->routing);
+    if (!planned)
+      continue;
+    pthread_rwlock_wrlock(&st->routing);
+    done = true;
+    for (int i = 0; i < n && done; ++i)
+      done = st->shards[i].version == versions[i];
+    if (done)
+      redistribute(st, cuts);
+    pthread_rwlock_unlock(&st->routing);
+  }
+  free(versions);
+  free(cuts);
+  return done;
+}
+
+void btree_sharded_destroy(BTreeSharded *st)
+{
+  for (int i = 0; i < st->nshards; ++i) {
+    btree_destroy(st->shards[i].tree);
+    pthread_mutex_destroy(&st->shards[i].lock);
+  }
+  pthread_rwlock_destroy(&st->routing);
+  free(st->bounds);
+  free(st->shards);
+  free(st);
+}
@@ -0,0 +1,87 @@
+#ifndef BTREE_SHARDED
+#define BTREE_SHARDED
+
+#include <pthread.h>
+
+#include "btree.h"
+
+/**
+  * One independent tree of a sharded container, with its own lock. Shards
+  * are cache-line aligned so that threads working on neighbouring shards
+  * do not share lines. 'size' mirrors the tree's size for lock-free
+  * readers; 'version' counts the changes made to the shard.
+  **/
+struct BTreeShard {
+  BTree *tree;
+  pthread_mutex_t lock;
+  size_t size;
+  unsigned long version;
+} __attribute__((aligned(BTREE_CACHE_LINE)));
+
+/**
+  * A container that partitions the key space into ranges, one tree per
+  * range. bounds[i] is the smallest key routed to shard i + 1; a NULL bound
+  * stands for +infinity. Point operations take the routing lock shared and
+  * a single shard lock; rebalancing takes the routing lock exclusively.
+  **/
+struct BTreeSharded {
+  int (*cmp)(void *, void *);
+  int nshards;
+  struct BTreeShard *shards;
+  void **bounds;
+  pthread_rwlock_t routing;
+  double max_skew;
+  int rebalancing;
+};
+
+typedef struct BTreeShard BTreeShard;
+typedef struct BTreeSharded BTreeSharded;
+
+/**
+  * Creates a container of 'nshards' trees. 'bounds' holds nshards - 1
+  * ascending split keys (NULL puts every key into the first shard until the
+  * first rebalance); the client must keep them valid while they are in use.
+  * Bounds picked by rebalancing are elements of the container.
+  **/
+BTreeSharded* btree_sharded_create(int (*cmp) (void *, void *), int nshards, void **bounds);
+
+bool btree_sharded_insert(BTreeSharded *st, void *data);
+
+bool btree_sharded_member(BTreeSharded *st, void *data);
+
+/**
+  * Removes the element equal to 'data'. Returns false if there was none.
+  **/
+bool btree_sharded_remove(BTreeSharded *st, void *data);
+
+size_t btree_sharded_size(BTreeSharded *st);
+
+/**
+  * Calls 'cb' on every element in ascending order, one shard at a time.
+  **/
+void btree_sharded_foreach(BTreeSharded *st, void (*cb)(void *data, void *arg), void *arg);
+
+/**
+  * Calls 'cb' on every element in [lo, hi] in ascending order, crossing
+  * shard boundaries as needed. Returns the number of visited elements.
+  **/
+size_t btree_sharded_range(BTreeSharded *st, void *lo, void *hi,
+    void (*cb)(void *data, void *arg), void *arg);
+
+/**
+  * Redistributes the elements so that every shard holds about the same
+  * number of them, and resets the bounds accordingly. The new bounds are
+  * located with only the routing lock shared and one shard lock held at a
+  * time; since nodes keep no subtree sizes, this walks up to half of each
+  * shard that holds a bound, O(n) in all. The routing lock is then taken
+  * exclusively just to join the shards and split them at those bounds,
+  * which takes O(nshards log n). Changes made in between make it start
+  * over; after a few attempts it gives up and returns false, leaving the
+  * shards as they were. Inserts call it by themselves once a shard grows
+  * past 'max_skew' times the average, and try again on later growth.
+  **/
+bool btree_sharded_rebalance(BTreeSharded *st);
+
+void btree_sharded_destroy(BTreeSharded *st);
+
+#endif  // BTREE_SHARDED
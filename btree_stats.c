@@ -0,0 +1,132 @@
+#include <string.h>
+#include <time.h>
+
+#include "btree_stats.h"
+
+static const char *op_names[BTREE_OP_COUNT] = {"insert", "find", "remove"};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t v)
+{
+  if (v < BTREE_HIST_SUB_BUCKETS)
+    return (int)v;
+  int shift = 63 - __builtin_clzll(v) - 4;
+  return (shift + 1) * BTREE_HIST_SUB_BUCKETS + (int)(v >> shift) - BTREE_HIST_SUB_BUCKETS;
+}
+
+/* Returns the largest value that falls into bucket 'b'. */
+static uint64_t bucket_end(int b)
+{
+  if (b < BTREE_HIST_SUB_BUCKETS)
+    return b;
+  int shift = b / BTREE_HIST_SUB_BUCKETS - 1;
+  uint64_t start = (uint64_t)(BTREE_HIST_SUB_BUCKETS + b % BTREE_HIST_SUB_BUCKETS) << shift;
+  return start + ((uint64_t)1 << shift) - 1;
+}
+
+BTreeStats* btree_stats_create(BTree *tree, unsigned sample_every)
+{
+  BTreeStats *st = (BTreeStats*)malloc(sizeof(BTreeStats));
+  if (st == NULL)
+    return NULL;
+  st->tree = tree;
+  st->sample_every = (sample_every == 0)? 1 : sample_every;
+  for (int op = 0; op < BTREE_OP_COUNT; ++op)
+    st->countdown[op] = 1;
+  btree_stats_reset(st);
+  return st;
+}
+
+/* Returns the start time if this operation is sampled, or 0. */
+static uint64_t sample_begin(BTreeStats *st, BTreeOp op)
+{
+  if (--st->countdown[op] != 0)
+    return 0;
+  st->countdown[op] = st->sample_every;
+  return now_ns();
+}
+
+static void sample_end(BTreeStats *st, BTreeOp op, uint64_t start)
+{
+  if (start != 0)
+    btree_stats_record(&st->ops[op], now_ns() - start);
+}
+
+bool btree_stats_insert(BTreeStats *st, void *data)
+{
+  uint64_t start = sample_begin(st, BTREE_OP_INSERT);
+  bool res = btree_insert(st->tree, data);
+  sample_end(st, BTREE_OP_INSERT, start);
+  return res;
+}
+
+BTreeIterator btree_stats_find(BTreeStats *st, void *data)
+{
+  uint64_t start = sample_begin(st, BTREE_OP_FIND);
+  BTreeIterator res = btree_find(st->tree, data);
+  sample_end(st, BTREE_OP_FIND, start);
+  return res;
+}
+
+void btree_stats_remove(BTreeStats *st, BTreeIterator it)
+{
+  uint64_t start = sample_begin(st, BTREE_OP_REMOVE);
+  btree_remove(it);
+  sample_end(st, BTREE_OP_REMOVE, start);
+}
+
+void btree_stats_record(BTreeHistogram *h, uint64_t ns)
+{
+  h->counts[bucket_of(ns)] += 1;
+  h->total += 1;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+uint64_t btree_stats_percentile(BTreeHistogram *h, double p)
+{
+  if (h->total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(p * h->total);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->total)
+    rank = h->total;
+  uint64_t seen = 0;
+  for (int b = 0; b < BTREE_HIST_BUCKETS; ++b) {
+    seen += h->counts[b];
+    if (seen >= rank)
+      return (bucket_end(b) < h->max)? bucket_end(b) : h->max;
+  }
+  return h->max;
+}
+
+void btree_stats_dump(BTreeStats *st, FILE *out)
+{
+  for (int op = 0; op < BTREE_OP_COUNT; ++op) {
+    BTreeHistogram *h = &st->ops[op];
+    fprintf(out, "%-8s samples %llu  p50 %llu ns  p99 %llu ns  p999 %llu ns  max %llu ns\n",
+            op_names[op], (unsigned long long)h->total,
+            (unsigned long long)btree_stats_percentile(h, 0.5),
+            (unsigned long long)btree_stats_percentile(h, 0.99),
+            (unsigned long long)btree_stats_percentile(h, 0.999),
+            (unsigned long long)h->max);
+  }
+}
+
+void btree_stats_reset(BTreeStats *st)
+{
+  memset(st->ops, 0, sizeof(st->ops));
+}
+
+void btree_stats_destroy(BTreeStats *st)
+{
+  btree_destroy(st->tree);
+  free(st);
+}
@@ -0,0 +1,72 @@
+#ifndef BTREE_STATS
+#define BTREE_STATS
+
+#include <stdio.h>
+
+#include "btree.h"
+
+/* Each power of two of latency is split into this many linear buckets. */
+#define BTREE_HIST_SUB_BUCKETS 16
+#define BTREE_HIST_BUCKETS (61 * BTREE_HIST_SUB_BUCKETS)
+
+enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_FIND, BTREE_OP_REMOVE, BTREE_OP_COUNT};
+
+/**
+  * Log-linear latency histogram in nanoseconds. Values below 16 ns have
+  * buckets of their own; above that, a bucket is at most 1/16 of its value
+  * wide, so percentiles are accurate to about 6%.
+  **/
+struct BTreeHistogram {
+  uint64_t counts[BTREE_HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+/**
+  * A tree that times one in 'sample_every' inserts, finds and removes with
+  * CLOCK_MONOTONIC and records the latencies per operation. Each operation
+  * counts down on its own, so a periodic mix of operations cannot hide one
+  * of them from sampling. Like the tree itself, it must not be used by
+  * several threads at once.
+  **/
+struct BTreeStats {
+  BTree *tree;
+  unsigned sample_every;
+  unsigned countdown[BTREE_OP_COUNT];
+  BTreeHistogram ops[BTREE_OP_COUNT];
+};
+
+typedef struct BTreeHistogram BTreeHistogram;
+typedef struct BTreeStats BTreeStats;
+
+/**
+  * Wraps 'tree', sampling one operation in 'sample_every' (1 times them all).
+  * The wrapper owns the tree from now on and destroys it in
+  * btree_stats_destroy.
+  **/
+BTreeStats* btree_stats_create(BTree *tree, unsigned sample_every);
+
+bool btree_stats_insert(BTreeStats *st, void *data);
+
+BTreeIterator btree_stats_find(BTreeStats *st, void *data);
+
+void btree_stats_remove(BTreeStats *st, BTreeIterator it);
+
+void btree_stats_record(BTreeHistogram *h, uint64_t ns);
+
+/**
+  * Returns the latency in nanoseconds below which a fraction 'p' of the
+  * samples fall, rounded up to the end of its bucket; 0 without samples.
+  **/
+uint64_t btree_stats_percentile(BTreeHistogram *h, double p);
+
+/**
+  * Prints sample count, p50, p99, p999 and max for each operation.
+  **/
+void btree_stats_dump(BTreeStats *st, FILE *out);
+
+void btree_stats_reset(BTreeStats *st);
+
+void btree_stats_destroy(BTreeStats *st);
+
+#endif  // BTREE_STATS
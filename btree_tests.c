@@ -3,10 +3,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #include <algorithm>
+#include <set>
+#include <string>
 
 #include "btree.h"
+#include "btree_interval.h"
+#include "btree_sharded.h"
+#include "btree_fc.h"
+#include "btree_seqlock.h"
+#include "btree_parallel.h"
+#include "btree_arena.h"
+#include "btree_compact.h"
+#include "btree_stats.h"
+#include "btree_heat.h"
+#include "btree_trace.h"
+#include "btree_lean.h"
+#include "btree_hoh.h"
 
 #include "gtest/gtest.h"
 
@@ -16,7 +31,12 @@ int int_compare (void *va, void *vb)
 {
   int *a = (int*)va;
   int *b = (int*)vb;
-  return *a - *b;
+  return (*a > *b) - (*a < *b);
+}
+
+int str_compare (void *va, void *vb)
+{
+  return strcmp((char*)va, (char*)vb);
 }
 
 #define COLOR(node) (((node) == NULL)? BTREE_BLACK : (node)->color)
@@ -40,7 +60,7 @@ static bool correct_black_heights(Node *n, int cur, int *bh)
       *bh = cur;
     return cur == *bh;
   }
-  return correct_black_heights(n->right, cur + (n->color == BTREE_BLACK), bh) + correct_black_heights(n->right, cur + (n->color == BTREE_BLACK), bh);
+  return correct_black_heights(n->left, cur + (n->color == BTREE_BLACK), bh) && correct_black_heights(n->right, cur + (n->color == BTREE_BLACK), bh);
 }
 
 static bool is_correct_rb_tree(Node *root)
@@ -49,6 +69,26 @@ static bool is_correct_rb_tree(Node *root)
   return correct_coloring(root) && correct_black_heights(root, 1, &bh);
 }
 
+static Node* down_to_leftmost(Node *n)
+{
+  while (n->left != NULL)
+    n = n->left;
+  return n;
+}
+
+static Node* down_to_rightmost(Node *n)
+{
+  while (n->right != NULL)
+    n = n->right;
+  return n;
+}
+
+static int black_height(Node *root)
+{
+  int bh = -1;
+  return correct_black_heights(root, 0, &bh)? bh : -1;
+}
+
 static char* node_attrs(Node *n)
 {
   const size_t buf_sz = 1024;
@@ -186,6 +226,66 @@ TEST(BalancedTreeTests, TreeDumpTest) {
   btree_destroy(tree);
 }
 
+static size_t string_write(void *ctx, const char *buf, size_t len)
+{
+  ((std::string*)ctx)->append(buf, len);
+  return len;
+}
+
+static int format_node(Node *n, char *buf, size_t size, void * /*arg*/)
+{
+  return snprintf(buf, size, "%s", node_dump(n));
+}
+
+/* Recursive reference for btree_dump_to without limits. */
+static void dump_reference(Node *n, int indent, std::string *out)
+{
+  if (n != NULL)
+    dump_reference(n->right, indent + 4, out);
+  out->append(indent, ' ');
+  out->append(node_dump(n));
+  out->append("\n");
+  if (n != NULL)
+    dump_reference(n->left, indent + 4, out);
+}
+
+TEST(BalancedTreeTests, StreamingDumpTest) {
+  srand(time(NULL));
+  BTree *tree = btree_create(int_compare);
+  const int n = 5000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    std::swap(a[i], a[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&a[i]);
+  std::string text, expected;
+  BTreeWriter out = {string_write, &text};
+  ASSERT_TRUE(btree_dump_to(tree, out, format_node, NULL, -1, 0));
+  dump_reference(tree->root, 0, &expected);
+  EXPECT_EQ(expected, text);
+
+  text.clear();
+  ASSERT_TRUE(btree_dump_to(tree, out, format_node, NULL, 2, 0));
+  EXPECT_EQ((size_t)8, (size_t)std::count(text.begin(), text.end(), '.') / 3);
+  text.clear();
+  ASSERT_TRUE(btree_dump_to(tree, out, format_node, NULL, -1, 10));
+  EXPECT_EQ(text, expected.substr(0, text.size()));
+
+  text.clear();
+  ASSERT_TRUE(btree_dump_dot_to(tree, out, format_node, NULL, -1, 0));
+  EXPECT_EQ(btree_size(tree) - 1, (size_t)std::count(text.begin(), text.end(), '>'));
+  text.clear();
+  ASSERT_TRUE(btree_dump_dot_to(tree, out, format_node, NULL, -1, 100));
+  EXPECT_EQ((size_t)99, (size_t)std::count(text.begin(), text.end(), '>'));
+  text.clear();
+  ASSERT_TRUE(btree_dump_dot_to(tree, out, format_node, NULL, 1, 0));
+  EXPECT_EQ((size_t)2, (size_t)std::count(text.begin(), text.end(), '>'));
+  btree_destroy(tree);
+  free(a);
+}
+
 TEST(BalancedTreeTests, RedBlackPropertiesTest) {
   srand(time(NULL));
   BTree *tree = btree_create(int_compare);
@@ -266,4 +366,1429 @@ TEST(BalancedTreeTests, RemoveEmptyNodeTest) {
   BTreeIterator it = btree_begin(tree);
   btree_remove(it);
   btree_destroy(tree);
-}
\ No newline at end of file
+}
+
+TEST(BalancedTreeTests, RemoveKeepsOrderTest) {
+  BTree *tree = btree_create(int_compare);
+  const int n = 100;
+  int a[n];
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    btree_insert(tree, (void*)&a[i]);
+  }
+  for (int i = 0; i < n; i += 3)
+    btree_remove(btree_find(tree, (void*)&a[i]));
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(btree_member(tree, (void*)&a[i]), i % 3 != 0);
+  int prev = -1;
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it)) {
+    EXPECT_LT(prev, *(int*)(it.node->data));
+    prev = *(int*)(it.node->data);
+  }
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  btree_destroy(tree);
+}
+
+TEST(BalancedTreeTests, ReverseIterationTest) {
+  BTree *tree = btree_create(int_compare);
+  EXPECT_TRUE(btree_rbegin(tree).node == NULL);
+  EXPECT_FALSE(btree_has_prev(btree_end(tree)));
+  const int n = 1000;
+  int a[n];
+  for (int i = 0; i < n; ++i) {
+    a[i] = 2 * i;
+    btree_insert(tree, (void*)&a[i]);
+  }
+  int expected = 2 * (n - 1);
+  int count = 0;
+  for (BTreeIterator it = btree_rbegin(tree); it.node != NULL; it = btree_prev(it), ++count) {
+    EXPECT_EQ(expected, *(int*)(it.node->data));
+    expected -= 2;
+  }
+  EXPECT_EQ(n, count);
+
+  BTreeIterator it = btree_prev(btree_end(tree));
+  EXPECT_EQ(&a[n - 1], it.node->data);
+  int x = 501;
+  it = btree_lower_bound(tree, (void*)&x);
+  EXPECT_EQ(502, *(int*)it.node->data);
+  for (int k = 0; k < 10; ++k) {
+    ASSERT_TRUE(btree_has_prev(it));
+    it = btree_prev(it);
+    EXPECT_EQ(500 - 2 * k, *(int*)it.node->data);
+  }
+  it = btree_begin(tree);
+  EXPECT_FALSE(btree_has_prev(it));
+  it = btree_next(it);
+  EXPECT_TRUE(btree_has_prev(it));
+  EXPECT_EQ(btree_begin(tree).node, btree_prev(it).node);
+  btree_destroy(tree);
+}
+
+TEST(BalancedTreeTests, TopDownInsertRemoveTest) {
+  srand(time(NULL));
+  const int n = 4000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  bool *present = (bool*)calloc(n, sizeof(bool));
+  for (int i = 0; i < n; ++i)
+    a[i] = i;
+  BTree *tree = btree_create(int_compare);
+  EXPECT_FALSE(btree_remove_topdown(tree, (void*)&a[0]));
+  size_t size = 0;
+  for (int k = 0; k < 6 * n; ++k) {
+    int i = rand() % n;
+    if (rand() % 3 != 0) {
+      bool topdown = rand() % 4 != 0;
+      ASSERT_TRUE(topdown? btree_insert_topdown(tree, (void*)&a[i]) : btree_insert(tree, (void*)&a[i]));
+      size += !present[i];
+      present[i] = true;
+    } else if (rand() % 4 != 0) {
+      ASSERT_EQ(present[i], btree_remove_topdown(tree, (void*)&a[i]));
+      size -= present[i];
+      present[i] = false;
+    } else if (present[i]) {
+      btree_remove(btree_find(tree, (void*)&a[i]));
+      size -= 1;
+      present[i] = false;
+    }
+    ASSERT_EQ(size, btree_size(tree));
+    if (k % 97 == 0) {
+      ASSERT_TRUE(is_correct_rb_tree(tree->root));
+      ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+    }
+    if (size > 0) {
+      ASSERT_EQ(tree->first, down_to_leftmost(tree->root));
+      ASSERT_EQ(tree->last, down_to_rightmost(tree->root));
+    }
+  }
+  for (int i = 0; i < n; ++i)
+    ASSERT_EQ(present[i], btree_member(tree, (void*)&a[i]));
+  int prev = -1;
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it)) {
+    EXPECT_LT(prev, *(int*)(it.node->data));
+    prev = *(int*)(it.node->data);
+  }
+  for (int i = 0; i < n; ++i) {
+    ASSERT_EQ(present[i], btree_remove_topdown(tree, (void*)&a[i]));
+    ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+  }
+  EXPECT_TRUE(btree_isempty(tree));
+  EXPECT_EQ(0, btree_black_height(tree));
+  btree_destroy(tree);
+  free(present);
+  free(a);
+}
+
+static void count_interval(BTreeInterval *iv, void *arg)
+{
+  (void)iv;
+  *(int*)arg += 1;
+}
+
+static int64_t check_max_end(Node *n)
+{
+  if (n == NULL)
+    return INT64_MIN;
+  BTreeInterval *iv = (BTreeInterval*)n->data;
+  int64_t expected = std::max(iv->end, std::max(check_max_end(n->left), check_max_end(n->right)));
+  EXPECT_EQ(expected, iv->max_end);
+  return expected;
+}
+
+TEST(IntervalTreeTests, OverlapQueryTest) {
+  srand(time(NULL));
+  BTree *tree = btree_interval_create();
+  const int n = 2000;
+  BTreeInterval iv[n];
+  for (int i = 0; i < n; ++i) {
+    iv[i].start = rand() % 10000;
+    iv[i].end = iv[i].start + rand() % 200;
+    iv[i].data = NULL;
+    ASSERT_TRUE(btree_interval_insert(tree, &iv[i]));
+  }
+  for (int i = 0; i < n; i += 2)
+    btree_interval_remove(tree, &iv[i]);
+  check_max_end(tree->root);
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  for (int q = 0; q < 100; ++q) {
+    int64_t a = rand() % 10000;
+    int64_t b = a + rand() % 300;
+    int expected = 0;
+    for (int i = 1; i < n; i += 2)
+      expected += (iv[i].start <= b && iv[i].end >= a);
+    int reported = 0;
+    EXPECT_EQ((size_t)expected, btree_interval_overlaps(tree, a, b, count_interval, &reported));
+    EXPECT_EQ(expected, reported);
+    expected = 0;
+    for (int i = 1; i < n; i += 2)
+      expected += (iv[i].start <= a && iv[i].end >= a);
+    EXPECT_EQ((size_t)expected, btree_interval_stab(tree, a, count_interval, &reported));
+  }
+  btree_destroy(tree);
+}
+
+TEST(BalancedTreeTests, PriorityQueueTest) {
+  srand(time(NULL));
+  BTree *tree = btree_create(int_compare);
+  EXPECT_EQ(btree_first(tree), (void*)NULL);
+  EXPECT_EQ(btree_pop_last(tree), (void*)NULL);
+  const int n = 1000;
+  int keys[n], a[n];
+  for (int i = 0; i < n; ++i) {
+    keys[i] = a[i] = rand() % 100000;
+    btree_insert(tree, (void*)&keys[i]);
+  }
+  std::sort(a, a + n);
+  int lo = 0;
+  int hi = std::unique(a, a + n) - a - 1;
+  while (lo <= hi) {
+    ASSERT_EQ(a[lo], *(int*)btree_first(tree));
+    ASSERT_EQ(a[hi], *(int*)btree_last(tree));
+    ASSERT_EQ(btree_begin(tree).node->data, btree_first(tree));
+    if (rand() % 2) {
+      EXPECT_EQ(a[lo++], *(int*)btree_pop_first(tree));
+    } else {
+      EXPECT_EQ(a[hi--], *(int*)btree_pop_last(tree));
+    }
+    ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  }
+  EXPECT_TRUE(btree_isempty(tree));
+  EXPECT_EQ(btree_last(tree), (void*)NULL);
+  btree_destroy(tree);
+}
+
+TEST(BalancedTreeTests, InsertHintTest) {
+  srand(time(NULL));
+  BTree *tree = btree_create(int_compare);
+  const int n = 5000;
+  int a[n];
+  BTreeIterator hint = btree_begin(tree);
+  for (int i = 0; i < n; ++i) {
+    a[i] = (i % 10 == 0)? rand() % n : i;
+    BTreeIterator it = btree_insert_hint(tree, hint, (void*)&a[i]);
+    ASSERT_TRUE(it.node != NULL);
+    EXPECT_EQ(a[i], *(int*)(it.node->data));
+    hint = (i % 7 == 0)? btree_find(tree, (void*)&a[rand() % (i + 1)]) : it;
+  }
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  for (int i = 0; i < n; ++i)
+    EXPECT_TRUE(btree_member(tree, (void*)&a[i]));
+  int prev = -1;
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it)) {
+    EXPECT_LT(prev, *(int*)(it.node->data));
+    prev = *(int*)(it.node->data);
+  }
+  EXPECT_EQ(prev, *(int*)btree_last(tree));
+  btree_destroy(tree);
+}
+
+static void expect_run(BTree *tree, int from, int to)
+{
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+  EXPECT_EQ((size_t)(to - from), btree_size(tree));
+  int expected = from;
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it))
+    EXPECT_EQ(expected++, *(int*)(it.node->data));
+  EXPECT_EQ(to, expected);
+  if (from < to) {
+    EXPECT_EQ(from, *(int*)btree_first(tree));
+    EXPECT_EQ(to - 1, *(int*)btree_last(tree));
+  }
+}
+
+TEST(BalancedTreeTests, SplitJoinTest) {
+  srand(time(NULL));
+  const int n = 2000;
+  int a[n];
+  BTree *tree = btree_create(int_compare);
+  BTree *right = btree_create(int_compare);
+  int order[n];
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    order[i] = i;
+    std::swap(order[i], order[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < n; ++i)
+    btree_insert(tree, (void*)&a[order[i]]);
+  int cuts[] = {0, 1, n / 3, n - 1, n};
+  for (size_t c = 0; c < sizeof(cuts) / sizeof(cuts[0]); ++c) {
+    int cut = cuts[c];
+    BTreeIterator at = (cut == n)? btree_end(tree) : btree_find(tree, (void*)&a[cut]);
+    ASSERT_TRUE(btree_split(at, n - cut, right));
+    expect_run(tree, 0, cut);
+    expect_run(right, cut, n);
+    EXPECT_EQ(cut == n, btree_split(btree_begin(tree), cut, right));
+    ASSERT_TRUE(btree_join(tree, right));
+    expect_run(tree, 0, n);
+    expect_run(right, 0, 0);
+  }
+  // Trees of very different heights, joined from both sides.
+  for (int k = 1; k < 64; k += 3) {
+    ASSERT_TRUE(btree_split(btree_find(tree, (void*)&a[n - k]), k, right));
+    ASSERT_TRUE(btree_join(tree, right));
+    ASSERT_TRUE(btree_split(btree_find(tree, (void*)&a[k]), n - k, right));
+    expect_run(tree, 0, k);
+    ASSERT_TRUE(btree_join(tree, right));
+    expect_run(tree, 0, n);
+  }
+  expect_run(tree, 0, n);
+  btree_destroy(right);
+  btree_destroy(tree);
+}
+
+TEST(KeyedTreeTests, Int64KeysTest) {
+  srand(time(NULL));
+  EXPECT_TRUE(btree_create_keyed(BTREE_KEY_POINTER) == NULL);
+  EXPECT_TRUE(btree_create_keyed(BTREE_KEY_PREFIX) == NULL);
+  BTree *tree = btree_create_keyed(BTREE_KEY_INT64);
+  const int n = 10000;
+  int64_t a[n];
+  a[0] = INT64_MIN;
+  a[1] = INT64_MAX;
+  for (int i = 0; i < n; ++i) {
+    if (i > 1)
+      a[i] = ((int64_t)rand() << 32 | rand()) * ((i % 2)? 1 : -1);
+    btree_insert(tree, (void*)&a[i]);
+  }
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  EXPECT_EQ(&a[0], btree_first(tree));
+  EXPECT_EQ(&a[1], btree_last(tree));
+  for (int i = 0; i < n; i += 2) {
+    int64_t key = a[i];
+    BTreeIterator it = btree_find(tree, (void*)&key);
+    ASSERT_TRUE(it.node != NULL);
+    EXPECT_EQ(a[i], it.node->key.i64);
+    btree_remove(it);
+  }
+  int64_t prev = INT64_MIN;
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it)) {
+    EXPECT_LT(prev, it.node->key.i64);
+    EXPECT_EQ(*(int64_t*)it.node->data, it.node->key.i64);
+    prev = it.node->key.i64;
+  }
+  for (int i = 1; i < n; i += 2)
+    EXPECT_TRUE(btree_member(tree, (void*)&a[i]));
+  btree_destroy(tree);
+}
+
+TEST(KeyedTreeTests, Uint64AndDoubleKeysTest) {
+  BTree *tree = btree_create_keyed(BTREE_KEY_UINT64);
+  uint64_t u[] = {UINT64_MAX, 0, 1ULL << 63, 42};
+  for (int i = 0; i < 4; ++i)
+    btree_insert(tree, (void*)&u[i]);
+  EXPECT_EQ(&u[1], btree_first(tree));
+  EXPECT_EQ(&u[0], btree_last(tree));
+  uint64_t key = 1ULL << 63;
+  EXPECT_TRUE(btree_member(tree, (void*)&key));
+  btree_destroy(tree);
+
+  tree = btree_create_keyed(BTREE_KEY_DOUBLE);
+  double d[] = {0.5, -1e300, 3.25, -0.125};
+  for (int i = 0; i < 4; ++i)
+    btree_insert(tree, (void*)&d[i]);
+  EXPECT_EQ(&d[1], btree_first(tree));
+  EXPECT_EQ(&d[0], btree_next(btree_find(tree, (void*)&d[3])).node->data);
+  double missing = 0.25;
+  EXPECT_FALSE(btree_member(tree, (void*)&missing));
+  btree_destroy(tree);
+}
+
+TEST(KeyedTreeTests, StringPrefixTest) {
+  srand(time(NULL));
+  BTree *tree = btree_create_prefixed(str_compare, btree_string_prefix);
+  const int n = 3000;
+  static char urls[n][64];
+  for (int i = 0; i < n; ++i) {
+    if (i % 3 == 0)
+      snprintf(urls[i], 64, "http://example.com/%d/%d", rand() % 100, i);
+    else if (i % 3 == 1)
+      snprintf(urls[i], 64, "%c%d", 'a' + rand() % 26, i);
+    else
+      snprintf(urls[i], 64, "%d", i);
+    btree_insert(tree, (void*)urls[i]);
+  }
+  ASSERT_TRUE(is_correct_rb_tree(tree->root));
+  for (int i = 0; i < n; i += 2) {
+    char key[64];
+    strcpy(key, urls[i]);
+    BTreeIterator it = btree_find(tree, (void*)key);
+    ASSERT_TRUE(it.node != NULL);
+    EXPECT_STREQ(key, (char*)it.node->data);
+    btree_remove(it);
+  }
+  char missing[] = "http://example.com/x";
+  EXPECT_FALSE(btree_member(tree, (void*)missing));
+  const char *prev = "";
+  for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it)) {
+    EXPECT_LT(strcmp(prev, (char*)it.node->data), 0);
+    EXPECT_EQ(btree_string_prefix(it.node->data), it.node->key.u64);
+    prev = (char*)it.node->data;
+  }
+  btree_destroy(tree);
+}
+
+static void check_ascending(void *data, void *arg)
+{
+  int **prev = (int**)arg;
+  EXPECT_TRUE(*prev == NULL || **prev < *(int*)data);
+  *prev = (int*)data;
+}
+
+TEST(ShardedTreeTests, RoutingAndRangeTest) {
+  const int n = 5000;
+  int split[] = {1000, 2000, 3000};
+  void *bounds[] = {&split[0], &split[1], &split[2]};
+  BTreeSharded *st = btree_sharded_create(int_compare, 4, bounds);
+  int a[n];
+  for (int i = 0; i < n; ++i) {
+    a[i] = (i * 7919) % n;
+    btree_sharded_insert(st, (void*)&a[i]);
+  }
+  EXPECT_EQ((size_t)n, btree_sharded_size(st));
+  EXPECT_EQ((size_t)1000, btree_size(st->shards[1].tree));
+  for (int i = 0; i < n; i += 2)
+    EXPECT_TRUE(btree_sharded_remove(st, (void*)&a[i]));
+  EXPECT_FALSE(btree_sharded_remove(st, (void*)&a[0]));
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(i % 2 == 1, btree_sharded_member(st, (void*)&a[i]));
+  int lo = 990, hi = 2010;
+  int *prev = NULL;
+  size_t expected = 0;
+  for (int i = 1; i < n; i += 2)
+    expected += (a[i] >= lo && a[i] <= hi);
+  EXPECT_EQ(expected, btree_sharded_range(st, &lo, &hi, check_ascending, &prev));
+  EXPECT_TRUE(btree_sharded_rebalance(st));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_NEAR(n / 8, btree_size(st->shards[i].tree), 1);
+    EXPECT_EQ(btree_size(st->shards[i].tree), st->shards[i].size);
+    EXPECT_TRUE(is_correct_rb_tree(st->shards[i].tree->root));
+    if (i > 0) {
+      EXPECT_EQ(btree_first(st->shards[i].tree), st->bounds[i - 1]);
+    }
+  }
+  prev = NULL;
+  btree_sharded_foreach(st, check_ascending, &prev);
+  EXPECT_EQ(btree_last(st->shards[3].tree), prev);
+  btree_sharded_destroy(st);
+}
+
+TEST(ShardedTreeTests, RebalanceFewElementsTest) {
+  BTreeSharded *st = btree_sharded_create(int_compare, 8, NULL);
+  int a[3] = {5, 6, 7};
+  for (int i = 0; i < 3; ++i)
+    btree_sharded_insert(st, (void*)&a[i]);
+  EXPECT_TRUE(btree_sharded_rebalance(st));
+  for (int i = 0; i < 8; ++i)
+    EXPECT_EQ((size_t)(i < 3), btree_size(st->shards[i].tree));
+  EXPECT_EQ((void*)&a[2], st->bounds[1]);
+  EXPECT_EQ((void*)NULL, st->bounds[2]);
+  EXPECT_EQ((size_t)3, btree_sharded_size(st));
+  for (int i = 0; i < 3; ++i)
+    EXPECT_TRUE(btree_sharded_member(st, (void*)&a[i]));
+  btree_sharded_destroy(st);
+}
+
+struct ShardedInsertJob {
+  BTreeSharded *st;
+  int *keys;
+  int n;
+};
+
+static void* sharded_insert_worker(void *arg)
+{
+  ShardedInsertJob *job = (ShardedInsertJob*)arg;
+  for (int i = 0; i < job->n; ++i) {
+    btree_sharded_insert(job->st, (void*)&job->keys[i]);
+    if (i % 3 == 0)
+      btree_sharded_remove(job->st, (void*)&job->keys[i]);
+  }
+  return NULL;
+}
+
+TEST(ShardedTreeTests, ConcurrentSkewedInsertTest) {
+  const int threads = 8;
+  const int per_thread = 20000;
+  BTreeSharded *st = btree_sharded_create(int_compare, 8, NULL);
+  int *keys = (int*)malloc(sizeof(int) * threads * per_thread);
+  pthread_t tids[threads];
+  ShardedInsertJob jobs[threads];
+  for (int t = 0; t < threads; ++t) {
+    jobs[t].st = st;
+    jobs[t].keys = keys + t * per_thread;
+    jobs[t].n = per_thread;
+    for (int i = 0; i < per_thread; ++i)
+      jobs[t].keys[i] = i * threads + t;
+    pthread_create(&tids[t], NULL, sharded_insert_worker, &jobs[t]);
+  }
+  for (int t = 0; t < threads; ++t)
+    pthread_join(tids[t], NULL);
+  EXPECT_EQ((size_t)(threads * (per_thread - (per_thread + 2) / 3)), btree_sharded_size(st));
+  EXPECT_FALSE(btree_isempty(st->shards[st->nshards - 1].tree));
+  for (int i = 0; i < threads * per_thread; ++i)
+    EXPECT_EQ((i % per_thread) % 3 != 0, btree_sharded_member(st, (void*)&keys[i]));
+  int *prev = NULL;
+  btree_sharded_foreach(st, check_ascending, &prev);
+  for (int i = 0; i < st->nshards; ++i)
+    EXPECT_TRUE(is_correct_rb_tree(st->shards[i].tree->root));
+  btree_sharded_destroy(st);
+  free(keys);
+}
+
+struct FCJob {
+  BTreeFC *fc;
+  int *keys;
+  int n;
+  int failures;
+  int slot;
+};
+
+static void* fc_worker(void *arg)
+{
+  FCJob *job = (FCJob*)arg;
+  int slot = btree_fc_register(job->fc);
+  job->slot = slot;
+  for (int i = 0; i < job->n; ++i) {
+    job->failures += !btree_fc_insert(job->fc, slot, (void*)&job->keys[i]);
+    job->failures += btree_fc_find(job->fc, slot, (void*)&job->keys[i]) != &job->keys[i];
+    if (i % 2 == 0)
+      job->failures += !btree_fc_remove(job->fc, slot, (void*)&job->keys[i]);
+  }
+  return NULL;
+}
+
+TEST(FlatCombiningTests, ConcurrentUpdatesTest) {
+  const int threads = 8;
+  const int per_thread = 5000;
+  BTreeFC *fc = btree_fc_create(btree_create(int_compare), threads);
+  int *keys = (int*)malloc(sizeof(int) * threads * per_thread);
+  pthread_t tids[threads];
+  FCJob jobs[threads];
+  for (int t = 0; t < threads; ++t) {
+    jobs[t].fc = fc;
+    jobs[t].keys = keys + t * per_thread;
+    jobs[t].n = per_thread;
+    jobs[t].failures = 0;
+    for (int i = 0; i < per_thread; ++i)
+      jobs[t].keys[i] = i * threads + t;
+    pthread_create(&tids[t], NULL, fc_worker, &jobs[t]);
+  }
+  for (int t = 0; t < threads; ++t) {
+    pthread_join(tids[t], NULL);
+    EXPECT_EQ(0, jobs[t].failures);
+  }
+  EXPECT_EQ(-1, btree_fc_register(fc));
+  btree_fc_unregister(fc, jobs[3].slot);
+  EXPECT_EQ(jobs[3].slot, btree_fc_register(fc));
+  EXPECT_EQ(-1, btree_fc_register(fc));
+  for (int t = 0; t < threads; ++t)
+    btree_fc_unregister(fc, jobs[t].slot);
+  // Short-lived threads reuse slots instead of using them up.
+  for (int i = 0; i < 100; ++i) {
+    jobs[0].n = 2;
+    pthread_create(&tids[0], NULL, fc_worker, &jobs[0]);
+    pthread_join(tids[0], NULL);
+    EXPECT_EQ(0, jobs[0].slot);
+    btree_fc_unregister(fc, jobs[0].slot);
+  }
+  EXPECT_EQ(threads, fc->used);
+  EXPECT_EQ((size_t)(threads * per_thread / 2), btree_size(fc->tree));
+  EXPECT_TRUE(is_correct_rb_tree(fc->tree->root));
+  btree_fc_destroy(fc);
+  free(keys);
+}
+
+struct SeqReaderJob {
+  BTreeSeq *st;
+  int64_t *keys;
+  int n;
+  volatile bool *stop;
+  int failures;
+};
+
+static void* seq_reader(void *arg)
+{
+  SeqReaderJob *job = (SeqReaderJob*)arg;
+  while (!*job->stop) {
+    for (int i = 0; i < job->n; i += 2) {
+      int64_t stable = job->keys[i];
+      job->failures += btree_seq_find(job->st, (void*)&stable) != &job->keys[i];
+      int64_t absent = -1 - job->keys[i];
+      job->failures += btree_seq_find(job->st, (void*)&absent) != NULL;
+    }
+  }
+  return NULL;
+}
+
+TEST(SeqlockTreeTests, LockFreeReadersTest) {
+  const int n = 2000;
+  const int readers = 4;
+  BTreeSeq *st = btree_seq_create(btree_create_keyed(BTREE_KEY_INT64));
+  int64_t keys[n];
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+    if (i % 2 == 0)
+      btree_seq_insert(st, (void*)&keys[i]);
+  }
+  volatile bool stop = false;
+  pthread_t tids[readers];
+  SeqReaderJob jobs[readers];
+  for (int t = 0; t < readers; ++t) {
+    SeqReaderJob job = {st, keys, n, &stop, 0};
+    jobs[t] = job;
+    pthread_create(&tids[t], NULL, seq_reader, &jobs[t]);
+  }
+  for (int round = 0; round < 20; ++round) {
+    for (int i = 1; i < n; i += 2)
+      EXPECT_TRUE(btree_seq_insert(st, (void*)&keys[i]));
+    for (int i = 1; i < n; i += 2)
+      EXPECT_TRUE(btree_seq_remove(st, (void*)&keys[i]));
+  }
+  stop = true;
+  for (int t = 0; t < readers; ++t) {
+    pthread_join(tids[t], NULL);
+    EXPECT_EQ(0, jobs[t].failures);
+  }
+  EXPECT_EQ((size_t)(n / 2), btree_size(st->tree));
+  EXPECT_TRUE(is_correct_rb_tree(st->tree->root));
+  btree_seq_destroy(st);
+}
+
+TEST(ParallelTreeTests, BuildParallelTest) {
+  srand(time(NULL));
+  const int sizes[] = {0, 1, 2, 3, 7, 8, 1000, 65535, 100000};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+    int n = sizes[k];
+    int *a = (int*)malloc(sizeof(int) * (n + 1));
+    void **items = (void**)malloc(sizeof(void*) * (n + 1));
+    for (int i = 0; i < n; ++i) {
+      a[i] = rand() % (n + 1);
+      items[i] = &a[i];
+    }
+    BTree *tree = btree_build_parallel(int_compare, items, n, 1 + k % 5);
+    ASSERT_TRUE(tree != NULL);
+    ASSERT_TRUE(is_correct_rb_tree(tree->root));
+    for (int i = 0; i < n; ++i) {
+      BTreeIterator it = btree_find(tree, (void*)&a[i]);
+      ASSERT_TRUE(it.node != NULL);
+      EXPECT_EQ(a[i], *(int*)it.node->data);
+      EXPECT_LE(it.node->data, (void*)&a[i]);
+    }
+    size_t count = 0;
+    int *prev = NULL;
+    for (BTreeIterator it = btree_begin(tree); it.node != NULL; it = btree_next(it), ++count) {
+      check_ascending(it.node->data, &prev);
+      EXPECT_EQ(it.node->left == NULL || it.node->left->parent == it.node, true);
+    }
+    EXPECT_EQ(count, btree_size(tree));
+    EXPECT_EQ((void*)prev, btree_last(tree));
+    a[n] = n + 1;
+    btree_insert(tree, (void*)&a[n]);
+    EXPECT_EQ((void*)&a[n], btree_last(tree));
+    ASSERT_TRUE(is_correct_rb_tree(tree->root));
+    btree_destroy(tree);
+    free(items);
+    free(a);
+  }
+}
+
+TEST(BalancedTreeTests, IncrementalDestroyTest) {
+  const int n = 10000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTree *tree = btree_create(int_compare);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    btree_insert(tree, (void*)&a[i]);
+  }
+  int steps = 1;
+  while (!btree_destroy_step(tree, 100))
+    steps += 1;
+  EXPECT_GE(steps, n / 100);
+  EXPECT_LE(steps, 2 * n / 100 + 1);
+  EXPECT_TRUE(btree_destroy_step(btree_create(int_compare), 0));
+
+  for (int k = 0; k < 4; ++k) {
+    tree = btree_create(int_compare);
+    for (int i = 0; i < n; ++i)
+      btree_insert(tree, (void*)&a[i]);
+    btree_destroy_async(tree);
+  }
+  btree_reclaim_wait();
+  free(a);
+}
+
+TEST(BalancedTreeTests, BlackHeightAndMemoryTest) {
+  srand(time(NULL));
+  const int n = 3000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTree *tree = btree_create(int_compare);
+  EXPECT_EQ(0, btree_black_height(tree));
+  EXPECT_EQ(0.0, btree_memory_usage(tree).bytes_per_element);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    std::swap(a[i], a[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < n; ++i) {
+    btree_insert(tree, (void*)&a[i]);
+    ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+  }
+  EXPECT_LE(btree_height(tree), 2 * btree_black_height(tree));
+  BTreeMemory mem = btree_memory_usage(tree);
+  EXPECT_EQ(n * sizeof(Node), mem.node_bytes);
+  EXPECT_GT(mem.overhead_bytes, (size_t)0);
+  EXPECT_GE(mem.bytes_per_element, (double)sizeof(Node));
+  for (int i = 0; i < n; ++i) {
+    btree_remove(btree_find(tree, (void*)&a[rand() % n]));
+    ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+  }
+  while (!btree_isempty(tree)) {
+    btree_pop_last(tree);
+    ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+  }
+  EXPECT_EQ(0, btree_black_height(tree));
+  btree_destroy(tree);
+
+  void **items = (void**)malloc(sizeof(void*) * n);
+  for (int m = 1; m <= n; m = m * 3 + 1) {
+    for (int i = 0; i < m; ++i)
+      items[i] = (void*)&a[i];
+    tree = btree_build_parallel(int_compare, items, m, 2);
+    ASSERT_EQ(black_height(tree->root), btree_black_height(tree));
+    btree_destroy(tree);
+  }
+  free(items);
+
+  tree = btree_create_keyed(BTREE_KEY_INT64);
+  ASSERT_TRUE(btree_use_arena(tree, 4096, 0));
+  int64_t keys[100];
+  for (int i = 0; i < 100; ++i) {
+    keys[i] = i;
+    btree_insert(tree, (void*)&keys[i]);
+  }
+  mem = btree_memory_usage(tree);
+  EXPECT_GT(mem.node_bytes + mem.overhead_bytes, ((BTreeArena*)tree->allocator.ctx)->mapped);
+  btree_destroy(tree);
+  free(a);
+}
+
+static void count_visits(void *data, void *arg)
+{
+  int *visits = (int*)arg;
+  __atomic_add_fetch(&visits[*(int*)data], 1, __ATOMIC_RELAXED);
+}
+
+TEST(ParallelTreeTests, SplitChunksAndForeachTest) {
+  srand(time(NULL));
+  const int sizes[] = {0, 1, 2, 5, 1000, 100000};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+    int n = sizes[k];
+    SCOPED_TRACE(n);
+    int *a = (int*)malloc(sizeof(int) * (n + 1));
+    BTree *tree = btree_create(int_compare);
+    for (int i = 0; i < n; ++i) {
+      a[i] = i;
+      std::swap(a[i], a[rand() % (i + 1)]);
+    }
+    for (int i = 0; i < n; ++i)
+      btree_insert(tree, (void*)&a[i]);
+    // One spare entry past 'max' catches writes beyond the end.
+    BTreeIterator bounds[65];
+    const size_t maxes[] = {1, 2, 3, 4, 16, 64};
+    for (size_t j = 0; j < sizeof(maxes) / sizeof(maxes[0]); ++j) {
+      size_t max = maxes[j];
+      bounds[max].node = NULL;
+      size_t count = btree_split_chunks(tree, bounds, max);
+      EXPECT_LE(count, max);
+      EXPECT_TRUE(bounds[max].node == NULL);
+      EXPECT_EQ(n == 0, count == 0);
+      if (n >= 1000) {
+        EXPECT_EQ(max, count);
+      }
+      if (count > 0) {
+        EXPECT_EQ(tree->first, bounds[0].node);
+      }
+      for (size_t i = 1; i < count; ++i)
+        EXPECT_LT(*(int*)bounds[i - 1].node->data, *(int*)bounds[i].node->data);
+    }
+    int *visits = (int*)calloc(n + 1, sizeof(int));
+    for (int threads = 1; threads <= 4; threads += 3)
+      ASSERT_TRUE(btree_parallel_foreach(tree, count_visits, visits, threads));
+    for (int i = 0; i < n; ++i)
+      ASSERT_EQ(2, visits[i]);
+    btree_destroy(tree);
+    free(visits);
+    free(a);
+  }
+}
+
+static int64_t map_value(void *data, void * /*arg*/)
+{
+  return *(int*)data;
+}
+
+static int64_t map_one(void * /*data*/, void * /*arg*/)
+{
+  return 1;
+}
+
+static int64_t add(int64_t a, int64_t b)
+{
+  return a + b;
+}
+
+/* Associative but not commutative: the result is the leftmost non-identity operand. */
+static int64_t keep_first(int64_t a, int64_t b)
+{
+  return (a == -1)? b : a;
+}
+
+TEST(ParallelTreeTests, ReduceRangeTest) {
+  srand(time(NULL));
+  const int n = 50000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTree *tree = btree_create(int_compare);
+  EXPECT_EQ(0, btree_reduce(tree, NULL, NULL, map_one, add, 0, NULL, 4));
+  for (int i = 0; i < n; ++i) {
+    a[i] = 2 * i;
+    btree_insert(tree, (void*)&a[i]);
+  }
+  for (int k = 0; k < 50; ++k) {
+    int lo = rand() % (2 * n + 10) - 5;
+    int hi = lo + rand() % (2 * n);
+    int64_t count = 0, sum = 0, first = -1;
+    for (int i = 0; i < n; ++i) {
+      if (a[i] >= lo && a[i] < hi) {
+        count += 1;
+        sum += a[i];
+        if (first == -1)
+          first = a[i];
+      }
+    }
+    int threads = 1 + k % 6;
+    EXPECT_EQ(count, btree_reduce(tree, &lo, &hi, map_one, add, 0, NULL, threads));
+    EXPECT_EQ(sum, btree_reduce(tree, &lo, &hi, map_value, add, 0, NULL, threads));
+    EXPECT_EQ(first, btree_reduce(tree, &lo, &hi, map_value, keep_first, -1, NULL, threads));
+  }
+  // A range covering 5% of the tree is still cut into 'max' chunks.
+  int range_lo = n / 2, range_hi = n / 2 + n / 10;
+  BTreeIterator bounds[256];
+  for (size_t max = 1; max <= 256; max *= 4) {
+    size_t count = btree_split_range(tree, &range_lo, &range_hi, bounds, max);
+    ASSERT_EQ(max, count);
+    EXPECT_EQ(range_lo, *(int*)bounds[0].node->data);
+    for (size_t i = 1; i < count; ++i) {
+      EXPECT_LT(*(int*)bounds[i - 1].node->data, *(int*)bounds[i].node->data);
+      EXPECT_LT(*(int*)bounds[i].node->data, range_hi);
+    }
+  }
+  EXPECT_EQ((size_t)0, btree_split_range(tree, &range_hi, &range_lo, bounds, 4));
+  // Open on the left, the first piece may be the only whole subtree.
+  for (int k = 1; k < 2 * n; k += 997) {
+    EXPECT_EQ((size_t)1, btree_split_range(tree, NULL, &k, bounds, 1));
+    EXPECT_EQ(tree->first, bounds[0].node);
+  }
+  int hi = 1000;
+  EXPECT_EQ(500, btree_reduce(tree, NULL, &hi, map_one, add, 0, NULL, 3));
+  int lo = 2 * n - 10;
+  EXPECT_EQ(5, btree_reduce(tree, &lo, NULL, map_one, add, 0, NULL, 3));
+  EXPECT_EQ(0, btree_reduce(tree, &hi, &hi, map_one, add, 0, NULL, 3));
+  EXPECT_EQ(n, btree_reduce(tree, NULL, NULL, map_one, add, 0, NULL, 8));
+  btree_destroy(tree);
+  free(a);
+}
+
+TEST(ArenaTreeTests, ArenaInsertRemoveTest) {
+  srand(time(NULL));
+  const int flags[] = {0, BTREE_ARENA_THP, BTREE_ARENA_HUGETLB};
+  for (int f = 0; f < 3; ++f) {
+    BTree *tree = btree_create_keyed(BTREE_KEY_INT64);
+    ASSERT_TRUE(btree_use_arena(tree, 4096, flags[f]));
+    BTreeArena *arena = (BTreeArena*)tree->allocator.ctx;
+    const int n = 20000;
+    int64_t *a = (int64_t*)malloc(sizeof(int64_t) * n);
+    for (int i = 0; i < n; ++i) {
+      a[i] = i;
+      btree_insert(tree, (void*)&a[i]);
+    }
+    size_t mapped = arena->mapped;
+    EXPECT_GE(mapped, n * sizeof(Node));
+    EXPECT_TRUE(tree->allocator.alloc(arena, arena->chunk_size) == NULL);
+    EXPECT_EQ(mapped, arena->mapped);
+    for (int i = 0; i < n; i += 2)
+      btree_remove(btree_find(tree, (void*)&a[i]));
+    for (int i = 0; i < n; i += 2)
+      btree_insert(tree, (void*)&a[i]);
+    EXPECT_EQ(mapped, arena->mapped);
+    EXPECT_EQ((size_t)n, btree_size(tree));
+    ASSERT_TRUE(is_correct_rb_tree(tree->root));
+    btree_destroy(tree);
+    free(a);
+  }
+}
+
+/* Returns the black height of the subtree at 'i', or -1 if it is not a valid red-black tree. */
+static int compact_black_height(BTreeCompact *t, uint32_t i)
+{
+  if (i == BTREE_NIL)
+    return 1;
+  CompactNode *n = &t->nodes[i];
+  if (n->color == BTREE_RED && (t->nodes[n->left].color == BTREE_RED || t->nodes[n->right].color == BTREE_RED))
+    return -1;
+  if ((n->left != BTREE_NIL && t->nodes[n->left].parent != i) ||
+      (n->right != BTREE_NIL && t->nodes[n->right].parent != i))
+    return -1;
+  int lh = compact_black_height(t, n->left);
+  int rh = compact_black_height(t, n->right);
+  if (lh == -1 || lh != rh)
+    return -1;
+  return lh + (n->color == BTREE_BLACK);
+}
+
+TEST(CompactTreeTests, InsertRemoveIterateTest) {
+  srand(time(NULL));
+  EXPECT_EQ((size_t)24, sizeof(CompactNode));
+  EXPECT_LT(sizeof(CompactNode), sizeof(Node));
+  BTreeCompact *tree = btree_compact_create(int_compare);
+  const int n = 20000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    std::swap(a[i], a[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < n; ++i)
+    ASSERT_TRUE(btree_compact_insert(tree, (void*)&a[i]));
+  EXPECT_EQ((size_t)n, tree->size);
+  ASSERT_NE(-1, compact_black_height(tree, tree->root));
+  for (int i = 0; i < n; i += 2)
+    ASSERT_TRUE(btree_compact_remove(tree, (void*)&a[i]));
+  EXPECT_FALSE(btree_compact_remove(tree, (void*)&a[0]));
+  ASSERT_NE(-1, compact_black_height(tree, tree->root));
+  uint32_t capacity = tree->capacity;
+  for (int i = 0; i < n; i += 2)
+    ASSERT_TRUE(btree_compact_insert(tree, (void*)&a[i]));
+  EXPECT_EQ(capacity, tree->capacity);
+  for (int i = 1; i < n; i += 2)
+    ASSERT_TRUE(btree_compact_remove(tree, (void*)&a[i]));
+  ASSERT_NE(-1, compact_black_height(tree, tree->root));
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(i % 2 == 0, btree_compact_member(tree, (void*)&a[i]));
+  int *prev = NULL;
+  size_t count = 0;
+  for (uint32_t i = btree_compact_begin(tree); i != BTREE_NIL; i = btree_compact_next(tree, i), ++count)
+    check_ascending(tree->nodes[i].data, &prev);
+  EXPECT_EQ(tree->size, count);
+  int *next = NULL;
+  for (uint32_t i = btree_compact_rbegin(tree); i != BTREE_NIL; i = btree_compact_prev(tree, i), --count) {
+    int *d = (int*)tree->nodes[i].data;
+    if (next != NULL) {
+      EXPECT_LT(*d, *next);
+    }
+    next = d;
+  }
+  EXPECT_EQ((size_t)0, count);
+  btree_compact_destroy(tree);
+  free(a);
+}
+
+TEST(StatsTests, HistogramAndSamplingTest) {
+  BTreeHistogram *h = (BTreeHistogram*)calloc(1, sizeof(BTreeHistogram));
+  EXPECT_EQ((uint64_t)0, btree_stats_percentile(h, 0.5));
+  for (uint64_t v = 1; v <= 1000; ++v)
+    btree_stats_record(h, v);
+  btree_stats_record(h, 1000000);
+  EXPECT_EQ((uint64_t)1001, h->total);
+  uint64_t p50 = btree_stats_percentile(h, 0.5);
+  EXPECT_GE(p50, (uint64_t)500);
+  EXPECT_LE(p50, (uint64_t)500 * 17 / 16);
+  EXPECT_EQ((uint64_t)7, btree_stats_percentile(h, 7.0 / 1001));
+  EXPECT_EQ((uint64_t)1000000, btree_stats_percentile(h, 1.0));
+  free(h);
+
+  const int n = 1000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTreeStats *st = btree_stats_create(btree_create(int_compare), 4);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    ASSERT_TRUE(btree_stats_insert(st, (void*)&a[i]));
+  }
+  for (int i = 0; i < n; ++i)
+    ASSERT_EQ(&a[i], btree_stats_find(st, (void*)&a[i]).node->data);
+  for (int i = 0; i < n; ++i)
+    btree_stats_remove(st, btree_find(st->tree, (void*)&a[i]));
+  EXPECT_TRUE(btree_isempty(st->tree));
+  for (int op = 0; op < BTREE_OP_COUNT; ++op) {
+    EXPECT_EQ((uint64_t)n / 4, st->ops[op].total);
+    EXPECT_LE(btree_stats_percentile(&st->ops[op], 0.5), btree_stats_percentile(&st->ops[op], 0.999));
+  }
+  btree_stats_reset(st);
+  EXPECT_EQ((uint64_t)0, st->ops[BTREE_OP_FIND].total);
+  btree_stats_destroy(st);
+
+  // Alternating operations with an even period still sample both.
+  st = btree_stats_create(btree_create(int_compare), 2);
+  for (int i = 0; i < n; ++i) {
+    btree_stats_insert(st, (void*)&a[i]);
+    btree_stats_find(st, (void*)&a[i]);
+  }
+  EXPECT_EQ((uint64_t)n / 2, st->ops[BTREE_OP_INSERT].total);
+  EXPECT_EQ((uint64_t)n / 2, st->ops[BTREE_OP_FIND].total);
+  btree_stats_destroy(st);
+  free(a);
+}
+
+TEST(HeatTests, HotKeysAndDepthTest) {
+  EXPECT_EQ((size_t)48, sizeof(Node));
+  const int n = 1000;
+  int a[n];
+  BTree *tree = btree_create(int_compare);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    btree_insert(tree, (void*)&a[i]);
+  }
+  btree_heat_enable(tree, 1);
+  for (int i = 0; i < 100; ++i)
+    btree_find(tree, (void*)&a[7]);
+  for (int i = 0; i < 50; ++i)
+    btree_find(tree, (void*)&a[500]);
+  for (int i = 0; i < 10; ++i)
+    btree_member(tree, (void*)&a[3]);
+  for (BTreeIterator it = btree_begin(tree); btree_has_more(it); it = btree_next(it))
+    ;
+  Node *top[4];
+  ASSERT_EQ((size_t)4, btree_heat_top(tree, top, 4));
+  EXPECT_EQ(7, *(int*)top[0]->data);
+  EXPECT_EQ((uint32_t)101, top[0]->hits);
+  EXPECT_EQ(500, *(int*)top[1]->data);
+  EXPECT_EQ(3, *(int*)top[2]->data);
+  EXPECT_EQ((uint32_t)1, top[3]->hits);
+
+  uint64_t hist[32];
+  int height = btree_heat_by_depth(tree, hist, 32);
+  EXPECT_EQ(btree_height(tree), height);
+  uint64_t total = 0;
+  for (int d = 0; d < height; ++d)
+    total += hist[d];
+  EXPECT_EQ((uint64_t)(100 + 50 + 10 + n), total);
+
+  for (int i = 0; i < n; i += 2)
+    if (i != 500)
+      btree_remove(btree_find(tree, (void*)&a[i]));
+  ASSERT_EQ((size_t)2, btree_heat_top(tree, top, 2));
+  EXPECT_EQ(7, *(int*)top[0]->data);
+  EXPECT_EQ(500, *(int*)top[1]->data);
+
+  char buf[256];
+  uint32_t max = top[0]->hits;
+  btree_heat_attributes(top[1], buf, sizeof(buf), &max);
+  EXPECT_TRUE(strstr(buf, "fillcolor") != NULL);
+
+  btree_heat_reset(tree);
+  EXPECT_EQ((size_t)0, btree_heat_top(tree, top, 4));
+  // Removing the minimum is not an access to its successor.
+  BTreeIterator min = {tree, tree->first};
+  btree_remove(min);
+  EXPECT_EQ((size_t)0, btree_heat_top(tree, top, 4));
+  btree_heat_enable(tree, 10);
+  for (int i = 0; i < 1000; ++i)
+    btree_find(tree, (void*)&a[7]);
+  EXPECT_EQ((uint32_t)100, btree_find(tree, (void*)&a[7]).node->hits);
+  btree_heat_enable(tree, 0);
+  btree_find(tree, (void*)&a[7]);
+  EXPECT_EQ((uint32_t)100, btree_find(tree, (void*)&a[7]).node->hits);
+  btree_destroy(tree);
+}
+
+TEST(TraceTests, RecordAndReadTest) {
+  FILE *f = tmpfile();
+  ASSERT_TRUE(f != NULL);
+  const int n = 300;
+  int64_t keys[n];
+  BTreeTrace *tr = btree_trace_create(btree_create_keyed(BTREE_KEY_INT64), f, NULL);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = (i % 2 == 0)? i * 1000003LL : -i;
+    ASSERT_TRUE(btree_trace_insert(tr, (void*)&keys[i]));
+  }
+  EXPECT_EQ(&keys[5], btree_trace_find(tr, (void*)&keys[5]).node->data);
+  btree_trace_remove(tr, btree_find(tr->tree, (void*)&keys[7]));
+  BTreeIterator it = btree_trace_begin(tr);
+  it = btree_trace_next(tr, it);
+  it = btree_trace_rbegin(tr);
+  EXPECT_EQ(&keys[n - 2], it.node->data);
+  it = btree_trace_prev(tr, it);
+  btree_trace_destroy(tr);
+
+  rewind(f);
+  ASSERT_TRUE(btree_trace_read_header(f));
+  BTreeTraceRecord rec = {BTREE_TRACE_INSERT, 0, 0};
+  uint64_t prev_ns = 0;
+  for (int i = 0; i < n; ++i) {
+    ASSERT_TRUE(btree_trace_read(f, &rec));
+    EXPECT_EQ(BTREE_TRACE_INSERT, rec.op);
+    EXPECT_EQ(keys[i], rec.key);
+    EXPECT_GE(rec.time_ns, prev_ns);
+    prev_ns = rec.time_ns;
+  }
+  const BTreeTraceOp ops[] = {BTREE_TRACE_FIND, BTREE_TRACE_REMOVE, BTREE_TRACE_BEGIN, BTREE_TRACE_NEXT,
+                              BTREE_TRACE_RBEGIN, BTREE_TRACE_PREV};
+  const int64_t op_keys[] = {keys[5], keys[7], 0, 0, 0, 0};
+  for (int i = 0; i < 6; ++i) {
+    ASSERT_TRUE(btree_trace_read(f, &rec));
+    EXPECT_EQ(ops[i], rec.op);
+    EXPECT_EQ(op_keys[i], rec.key);
+  }
+  EXPECT_FALSE(btree_trace_read(f, &rec));
+  fclose(f);
+}
+
+struct TraceJob {
+  BTreeTrace *tr;
+  int64_t *keys;
+  int n;
+};
+
+static void* trace_finder(void *arg)
+{
+  TraceJob *job = (TraceJob*)arg;
+  for (int i = 0; i < job->n; ++i)
+    btree_trace_find(job->tr, (void*)&job->keys[i]);
+  return NULL;
+}
+
+TEST(TraceTests, SnapshotAndConcurrentRecordsTest) {
+  FILE *f = tmpfile();
+  ASSERT_TRUE(f != NULL);
+  const int n = 1000;
+  const int threads = 4;
+  int64_t keys[n];
+  BTree *tree = btree_create_keyed(BTREE_KEY_INT64);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = n - i;
+    btree_insert(tree, (void*)&keys[i]);
+  }
+  BTreeTrace *tr = btree_trace_create(tree, f, NULL);
+  // Finds do not modify the tree, so threads may share it without a lock.
+  pthread_t tids[threads];
+  TraceJob job = {tr, keys, n};
+  for (int t = 0; t < threads; ++t)
+    pthread_create(&tids[t], NULL, trace_finder, &job);
+  for (int t = 0; t < threads; ++t)
+    pthread_join(tids[t], NULL);
+  btree_trace_destroy(tr);
+
+  rewind(f);
+  ASSERT_TRUE(btree_trace_read_header(f));
+  BTreeTraceRecord rec = {BTREE_TRACE_INSERT, 0, 0};
+  for (int i = 1; i <= n; ++i) {
+    ASSERT_TRUE(btree_trace_read(f, &rec));
+    EXPECT_EQ(BTREE_TRACE_SNAPSHOT, rec.op);
+    EXPECT_EQ(i, rec.key);
+  }
+  int finds = 0;
+  while (btree_trace_read(f, &rec)) {
+    ASSERT_EQ(BTREE_TRACE_FIND, rec.op);
+    ASSERT_GE(rec.key, 1);
+    ASSERT_LE(rec.key, n);
+    finds += 1;
+  }
+  EXPECT_EQ(threads * n, finds);
+  EXPECT_TRUE(feof(f));
+  fclose(f);
+}
+
+/* Returns the black height of the subtree at 'n', or -1 if it is not a valid red-black tree. */
+static int lean_black_height(LeanNode *n)
+{
+  if (n == NULL)
+    return 1;
+  if (n->color == BTREE_RED && (COLOR(n->link[0]) == BTREE_RED || COLOR(n->link[1]) == BTREE_RED))
+    return -1;
+  int lh = lean_black_height(n->link[0]);
+  int rh = lean_black_height(n->link[1]);
+  if (lh == -1 || lh != rh)
+    return -1;
+  return lh + (n->color == BTREE_BLACK);
+}
+
+TEST(LeanTreeTests, InsertRemoveIterateTest) {
+  srand(time(NULL));
+  EXPECT_EQ((size_t)32, sizeof(LeanNode));
+  BTreeLean *tree = btree_lean_create(int_compare);
+  const int n = 20000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    std::swap(a[i], a[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < n; ++i)
+    ASSERT_TRUE(btree_lean_insert(tree, (void*)&a[i]));
+  EXPECT_FALSE(btree_lean_insert(tree, (void*)&a[0]));
+  EXPECT_EQ((size_t)n, tree->size);
+  ASSERT_NE(-1, lean_black_height(tree->root));
+  for (int i = 0; i < n; i += 2)
+    ASSERT_TRUE(btree_lean_remove(tree, (void*)&a[i]));
+  EXPECT_FALSE(btree_lean_remove(tree, (void*)&a[0]));
+  ASSERT_NE(-1, lean_black_height(tree->root));
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(i % 2 == 1, btree_lean_member(tree, (void*)&a[i]));
+  BTreeLeanCursor cursor;
+  int *prev = NULL;
+  size_t count = 0;
+  for (void *d = btree_lean_first(tree, &cursor); d != NULL; d = btree_lean_next(&cursor), ++count)
+    check_ascending(d, &prev);
+  EXPECT_EQ(tree->size, count);
+  for (int i = 1; i < n; i += 2) {
+    ASSERT_TRUE(btree_lean_remove(tree, (void*)&a[i]));
+    if (i % 1001 == 0) {
+      ASSERT_NE(-1, lean_black_height(tree->root));
+    }
+  }
+  EXPECT_TRUE(tree->root == NULL);
+  EXPECT_TRUE(btree_lean_first(tree, &cursor) == NULL);
+  for (int i = 0; i < n; ++i)
+    ASSERT_TRUE(btree_lean_insert(tree, (void*)&a[i]));
+  btree_lean_destroy(tree);
+  free(a);
+}
+
+static void collect_lean(LeanNode *n, std::set<LeanNode*> *nodes)
+{
+  if (n == NULL)
+    return;
+  nodes->insert(n);
+  collect_lean(n->link[0], nodes);
+  collect_lean(n->link[1], nodes);
+}
+
+TEST(LeanTreeTests, CloneTest) {
+  srand(time(NULL));
+  const int n = 4000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTreeLean *tree = btree_lean_create(int_compare);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    if (i % 2 == 0)
+      btree_lean_insert(tree, (void*)&a[i]);
+  }
+  BTreeLean *clone = btree_lean_clone(tree);
+  ASSERT_TRUE(clone != NULL);
+  EXPECT_EQ(tree->root, clone->root);
+  EXPECT_EQ((uint32_t)2, tree->root->refs);
+  // One write copies a path, not the tree.
+  ASSERT_TRUE(btree_lean_insert(clone, (void*)&a[1]));
+  std::set<LeanNode*> mine, theirs;
+  collect_lean(tree->root, &mine);
+  collect_lean(clone->root, &theirs);
+  size_t copied = 0;
+  for (std::set<LeanNode*>::iterator c = theirs.begin(); c != theirs.end(); ++c)
+    copied += (mine.count(*c) == 0);
+  EXPECT_LE(copied, (size_t)(4 * lean_black_height(clone->root) + 4));
+  BTreeLean *clone2 = btree_lean_clone(clone);
+  for (int i = 0; i < n; ++i) {
+    int k = rand() % n;
+    if (k % 2 == 0)
+      btree_lean_remove(clone, (void*)&a[k]);
+    else
+      btree_lean_insert(clone, (void*)&a[k]);
+    if (i % 3 == 0)
+      btree_lean_remove(tree, (void*)&a[(k / 2) * 2]);
+  }
+  ASSERT_NE(-1, lean_black_height(tree->root));
+  ASSERT_NE(-1, lean_black_height(clone->root));
+  ASSERT_NE(-1, lean_black_height(clone2->root));
+  for (int i = 0; i < n; ++i)
+    EXPECT_EQ(i % 2 == 0 || i == 1, btree_lean_member(clone2, (void*)&a[i]));
+  EXPECT_EQ((size_t)n / 2 + 1, clone2->size);
+  btree_lean_destroy(clone);
+  BTreeLeanCursor cursor;
+  int *prev = NULL;
+  size_t count = 0;
+  for (void *d = btree_lean_first(tree, &cursor); d != NULL; d = btree_lean_next(&cursor), ++count)
+    check_ascending(d, &prev);
+  EXPECT_EQ(tree->size, count);
+  btree_lean_destroy(tree);
+  for (int i = 0; i < n; i += 2)
+    ASSERT_TRUE(btree_lean_remove(clone2, (void*)&a[i]));
+  EXPECT_EQ((uint32_t)1, clone2->root->refs);
+  EXPECT_EQ((size_t)1, clone2->size);
+  btree_lean_destroy(clone2);
+  free(a);
+}
+
+TEST(LeanTreeTests, FromTreeTest) {
+  const int n = 3000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; ++i)
+    a[i] = i;
+  BTree *tree = btree_create(int_compare);
+  for (int size = 0; size < n; size = size * 2 + 1) {
+    for (int i = btree_size(tree); i < size; ++i)
+      btree_insert(tree, (void*)&a[i]);
+    BTreeLean *lean = btree_lean_from(tree);
+    ASSERT_TRUE(lean != NULL);
+    EXPECT_EQ((size_t)size, lean->size);
+    ASSERT_NE(-1, lean_black_height(lean->root));
+    BTreeLeanCursor cursor;
+    int *prev = NULL;
+    size_t count = 0;
+    for (void *d = btree_lean_first(lean, &cursor); d != NULL; d = btree_lean_next(&cursor), ++count)
+      check_ascending(d, &prev);
+    EXPECT_EQ((size_t)size, count);
+    btree_lean_destroy(lean);
+  }
+  for (int i = btree_size(tree); i < n; ++i)
+    btree_insert(tree, (void*)&a[i]);
+
+  // Forking a BTree: convert it once, then clone the lean tree.
+  BTreeLean *lean = btree_lean_from(tree);
+  btree_destroy(tree);
+  ASSERT_TRUE(lean != NULL);
+  BTreeLean *fork = btree_lean_clone(lean);
+  ASSERT_TRUE(fork != NULL);
+  for (int i = 0; i < n; i += 2)
+    ASSERT_TRUE(btree_lean_remove(fork, (void*)&a[i]));
+  ASSERT_NE(-1, lean_black_height(lean->root));
+  ASSERT_NE(-1, lean_black_height(fork->root));
+  for (int i = 0; i < n; ++i) {
+    EXPECT_TRUE(btree_lean_member(lean, (void*)&a[i]));
+    EXPECT_EQ(i % 2 == 1, btree_lean_member(fork, (void*)&a[i]));
+  }
+  btree_lean_destroy(lean);
+  btree_lean_destroy(fork);
+
+  tree = btree_create_keyed(BTREE_KEY_INT64);
+  EXPECT_TRUE(btree_lean_from(tree) == NULL);
+  btree_destroy(tree);
+  free(a);
+}
+
+struct LeanCloneJob {
+  BTreeLean *tree;
+  int *keys;
+  int n;
+  int offset;
+};
+
+static void* lean_clone_worker(void *arg)
+{
+  LeanCloneJob *job = (LeanCloneJob*)arg;
+  for (int i = job->offset; i < job->n; i += 4)
+    btree_lean_remove(job->tree, (void*)&job->keys[i]);
+  return NULL;
+}
+
+TEST(LeanTreeTests, ConcurrentClonesTest) {
+  const int threads = 4;
+  const int n = 20000;
+  int *a = (int*)malloc(sizeof(int) * n);
+  BTreeLean *tree = btree_lean_create(int_compare);
+  for (int i = 0; i < n; ++i) {
+    a[i] = i;
+    btree_lean_insert(tree, (void*)&a[i]);
+  }
+  pthread_t tids[threads];
+  LeanCloneJob jobs[threads];
+  for (int t = 0; t < threads; ++t) {
+    jobs[t].tree = btree_lean_clone(tree);
+    jobs[t].keys = a;
+    jobs[t].n = n;
+    jobs[t].offset = t;
+    pthread_create(&tids[t], NULL, lean_clone_worker, &jobs[t]);
+  }
+  btree_lean_destroy(tree);
+  for (int t = 0; t < threads; ++t) {
+    pthread_join(tids[t], NULL);
+    BTreeLean *clone = jobs[t].tree;
+    ASSERT_NE(-1, lean_black_height(clone->root));
+    EXPECT_EQ((size_t)(n - n / threads), clone->size);
+    for (int i = 0; i < n; ++i)
+      EXPECT_EQ(i % threads != t, btree_lean_member(clone, (void*)&a[i]));
+    btree_lean_destroy(clone);
+  }
+  free(a);
+}
+
+/* Like lean_black_height, and checks the in-order sequence with 'prev'. */
+static int hoh_black_height(HohNode *n, int **prev)
+{
+  if (n == NULL)
+    return 1;
+  if (n->color == BTREE_RED && (COLOR(n->link[0]) == BTREE_RED || COLOR(n->link[1]) == BTREE_RED))
+    return -1;
+  int lh = hoh_black_height(n->link[0], prev);
+  if (*prev != NULL && **prev >= *(int*)n->data)
+    return -1;
+  *prev = (int*)n->data;
+  int rh = hoh_black_height(n->link[1], prev);
+  if (lh == -1 || lh != rh)
+    return -1;
+  return lh + (n->color == BTREE_BLACK);
+}
+
+struct HohJob {
+  BTreeHoh *tree;
+  int *keys;
+  int n;
+  int failures;
+};
+
+static void* hoh_worker(void *arg)
+{
+  HohJob *job = (HohJob*)arg;
+  for (int i = 0; i < job->n; ++i) {
+    job->failures += !btree_hoh_insert(job->tree, (void*)&job->keys[i]);
+    job->failures += btree_hoh_find(job->tree, (void*)&job->keys[i]) != &job->keys[i];
+    if (i % 2 == 0)
+      job->failures += !btree_hoh_remove(job->tree, (void*)&job->keys[i]);
+  }
+  for (int i = 0; i < job->n; ++i)
+    job->failures += btree_hoh_member(job->tree, (void*)&job->keys[i]) != (i % 2 == 1);
+  return NULL;
+}
+
+TEST(HandOverHandTreeTests, ConcurrentWritersTest) {
+  EXPECT_EQ((size_t)32, sizeof(HohNode));
+  const int threads = 8;
+  const int per_thread = 5000;
+  BTreeHoh *tree = btree_hoh_create(int_compare);
+  int *keys = (int*)malloc(sizeof(int) * threads * per_thread);
+  pthread_t tids[threads];
+  HohJob jobs[threads];
+  for (int t = 0; t < threads; ++t) {
+    jobs[t].tree = tree;
+    jobs[t].keys = keys + t * per_thread;
+    jobs[t].n = per_thread;
+    jobs[t].failures = 0;
+    // Interleaved keys, so that all threads write all over the tree.
+    for (int i = 0; i < per_thread; ++i)
+      jobs[t].keys[i] = i * threads + t;
+    pthread_create(&tids[t], NULL, hoh_worker, &jobs[t]);
+  }
+  for (int t = 0; t < threads; ++t) {
+    pthread_join(tids[t], NULL);
+    EXPECT_EQ(0, jobs[t].failures);
+  }
+  EXPECT_EQ((size_t)(threads * per_thread / 2), btree_hoh_size(tree));
+  int *prev = NULL;
+  EXPECT_NE(-1, hoh_black_height(tree->head.link[1], &prev));
+  EXPECT_EQ(BTREE_BLACK, tree->head.link[1]->color);
+
+  // Single-threaded: duplicates, missing keys and emptying the tree.
+  EXPECT_FALSE(btree_hoh_insert(tree, (void*)&keys[1]));
+  EXPECT_FALSE(btree_hoh_remove(tree, (void*)&keys[0]));
+  for (int i = 1; i < threads * per_thread; i += 2) {
+    ASSERT_TRUE(btree_hoh_remove(tree, (void*)&keys[i]));
+    if (i % 1001 == 0) {
+      prev = NULL;
+      ASSERT_NE(-1, hoh_black_height(tree->head.link[1], &prev));
+    }
+  }
+  EXPECT_TRUE(tree->head.link[1] == NULL);
+  EXPECT_EQ((size_t)0, btree_hoh_size(tree));
+  EXPECT_TRUE(btree_hoh_find(tree, (void*)&keys[0]) == NULL);
+  for (int i = 0; i < threads * per_thread; ++i)
+    ASSERT_TRUE(btree_hoh_insert(tree, (void*)&keys[i]));
+  prev = NULL;
+  EXPECT_NE(-1, hoh_black_height(tree->head.link[1], &prev));
+  btree_hoh_destroy(tree);
+  free(keys);
+}
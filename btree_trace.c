@@ -0,0 +1,164 @@
+#include <string.h>
+#include <time.h>
+
+#include "btree_trace.h"
+
+static const char magic[] = {'B', 'T', 'R', 'C', 1};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t int64_key(void *data)
+{
+  return *(int64_t*)data;
+}
+
+static void write_varint(FILE *out, uint64_t v)
+{
+  while (v >= 0x80) {
+    putc((int)(v & 0x7f) | 0x80, out);
+    v >>= 7;
+  }
+  putc((int)v, out);
+}
+
+static bool read_varint(FILE *in, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(in);
+    if (c == EOF)
+      return false;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Iteration steps carry no key. */
+static bool has_key(int op)
+{
+  return op != BTREE_TRACE_BEGIN && op != BTREE_TRACE_NEXT && op != BTREE_TRACE_RBEGIN &&
+         op != BTREE_TRACE_PREV;
+}
+
+static void record(BTreeTrace *tr, BTreeTraceOp op, void *data)
+{
+  pthread_mutex_lock(&tr->lock);
+  uint64_t now = now_ns();
+  putc(op, tr->out);
+  write_varint(tr->out, now - tr->last_ns);
+  tr->last_ns = now;
+  if (has_key(op)) {
+    int64_t key = tr->key_of(data);
+    write_varint(tr->out, ((uint64_t)key << 1) ^ (uint64_t)(key >> 63));
+  }
+  pthread_mutex_unlock(&tr->lock);
+}
+
+/* Records the elements under 'n' in order; btree_next would count heat hits. */
+static void snapshot(BTreeTrace *tr, Node *n)
+{
+  if (n == NULL)
+    return;
+  snapshot(tr, n->left);
+  record(tr, BTREE_TRACE_SNAPSHOT, n->data);
+  snapshot(tr, n->right);
+}
+
+BTreeTrace* btree_trace_create(BTree *tree, FILE *out, int64_t (*key_of)(void *data))
+{
+  BTreeTrace *tr = (BTreeTrace*)malloc(sizeof(BTreeTrace));
+  if (tr == NULL)
+    return NULL;
+  tr->tree = tree;
+  tr->out = out;
+  tr->key_of = (key_of == NULL)? int64_key : key_of;
+  pthread_mutex_init(&tr->lock, NULL);
+  fwrite(magic, 1, sizeof(magic), out);
+  tr->last_ns = now_ns();
+  snapshot(tr, tree->root);
+  return tr;
+}
+
+bool btree_trace_insert(BTreeTrace *tr, void *data)
+{
+  record(tr, BTREE_TRACE_INSERT, data);
+  return btree_insert(tr->tree, data);
+}
+
+BTreeIterator btree_trace_find(BTreeTrace *tr, void *data)
+{
+  record(tr, BTREE_TRACE_FIND, data);
+  return btree_find(tr->tree, data);
+}
+
+void btree_trace_remove(BTreeTrace *tr, BTreeIterator it)
+{
+  if (it.node == NULL)
+    return;
+  record(tr, BTREE_TRACE_REMOVE, it.node->data);
+  btree_remove(it);
+}
+
+BTreeIterator btree_trace_begin(BTreeTrace *tr)
+{
+  record(tr, BTREE_TRACE_BEGIN, NULL);
+  return btree_begin(tr->tree);
+}
+
+BTreeIterator btree_trace_next(BTreeTrace *tr, BTreeIterator it)
+{
+  record(tr, BTREE_TRACE_NEXT, NULL);
+  return btree_next(it);
+}
+
+BTreeIterator btree_trace_rbegin(BTreeTrace *tr)
+{
+  record(tr, BTREE_TRACE_RBEGIN, NULL);
+  return btree_rbegin(tr->tree);
+}
+
+BTreeIterator btree_trace_prev(BTreeTrace *tr, BTreeIterator it)
+{
+  record(tr, BTREE_TRACE_PREV, NULL);
+  return btree_prev(it);
+}
+
+void btree_trace_destroy(BTreeTrace *tr)
+{
+  fflush(tr->out);
+  pthread_mutex_destroy(&tr->lock);
+  btree_destroy(tr->tree);
+  free(tr);
+}
+
+bool btree_trace_read_header(FILE *in)
+{
+  char header[sizeof(magic)];
+  return fread(header, 1, sizeof(header), in) == sizeof(header) &&
+         memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+bool btree_trace_read(FILE *in, BTreeTraceRecord *rec)
+{
+  int op = getc(in);
+  uint64_t delta = 0;
+  if (op == EOF || op > BTREE_TRACE_PREV || !read_varint(in, &delta))
+    return false;
+  rec->op = (BTreeTraceOp)op;
+  rec->time_ns += delta;
+  rec->key = 0;
+  if (has_key(op)) {
+    uint64_t v = 0;
+    if (!read_varint(in, &v))
+      return false;
+    rec->key = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+  return true;
+}
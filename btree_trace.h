@@ -0,0 +1,84 @@
+#ifndef BTREE_TRACE
+#define BTREE_TRACE
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "btree.h"
+
+/* BTREE_TRACE_SNAPSHOT records an element already present when tracing began. */
+enum BTreeTraceOp {BTREE_TRACE_INSERT, BTREE_TRACE_FIND, BTREE_TRACE_REMOVE, BTREE_TRACE_BEGIN,
+  BTREE_TRACE_NEXT, BTREE_TRACE_SNAPSHOT, BTREE_TRACE_RBEGIN, BTREE_TRACE_PREV};
+
+/**
+  * A tree that logs every insert, find, remove and iteration step, in
+  * either direction, to 'out'.
+  * The trace starts with a 5-byte header; each record is the op byte, the
+  * nanoseconds since the previous record as a varint and, except for
+  * iteration steps, the key as a zigzag varint. Keys are 64-bit integers
+  * obtained with 'key_of'.
+  *
+  * Records are written under 'lock', so threads sharing the tree (under
+  * their own synchronization) produce a well-formed trace. The record of an
+  * operation is written just before the operation runs, so concurrent
+  * operations may appear in either order.
+  **/
+struct BTreeTrace {
+  BTree *tree;
+  FILE *out;
+  int64_t (*key_of)(void *data);
+  uint64_t last_ns;
+  pthread_mutex_t lock;
+};
+
+/**
+  * One decoded record; 'time_ns' counts from the start of the trace.
+  **/
+struct BTreeTraceRecord {
+  BTreeTraceOp op;
+  int64_t key;
+  uint64_t time_ns;
+};
+
+typedef struct BTreeTrace BTreeTrace;
+typedef struct BTreeTraceRecord BTreeTraceRecord;
+
+/**
+  * Wraps 'tree' and writes the trace header to 'out', followed by a
+  * snapshot record for each element already in the tree, in order, so a
+  * replay starts from the same contents. 'key_of' maps an element to its
+  * key; NULL reads an int64_t from the element, as for BTREE_KEY_INT64
+  * trees. The wrapper owns the tree from now on and
+  * destroys it in btree_trace_destroy; 'out' is flushed but not closed.
+  **/
+BTreeTrace* btree_trace_create(BTree *tree, FILE *out, int64_t (*key_of)(void *data));
+
+bool btree_trace_insert(BTreeTrace *tr, void *data);
+
+BTreeIterator btree_trace_find(BTreeTrace *tr, void *data);
+
+void btree_trace_remove(BTreeTrace *tr, BTreeIterator it);
+
+BTreeIterator btree_trace_begin(BTreeTrace *tr);
+
+BTreeIterator btree_trace_next(BTreeTrace *tr, BTreeIterator it);
+
+BTreeIterator btree_trace_rbegin(BTreeTrace *tr);
+
+BTreeIterator btree_trace_prev(BTreeTrace *tr, BTreeIterator it);
+
+void btree_trace_destroy(BTreeTrace *tr);
+
+/**
+  * Checks the header of a trace opened for reading.
+  **/
+bool btree_trace_read_header(FILE *in);
+
+/**
+  * Reads the next record into 'rec', keeping its time running from
+  * 'rec->time_ns'. Returns false at the end of the trace or on a corrupt
+  * record.
+  **/
+bool btree_trace_read(FILE *in, BTreeTraceRecord *rec);
+
+#endif  // BTREE_TRACE
@@ -13,46 +13,39 @@ int int_compare (void *va, void *vb)
 {
   int *a = (int*)va;
   int *b = (int*)vb;
-  return *a - *b;
+  return (*a > *b) - (*a < *b);
 }
 
-char* node_attrs(Node *n)
+static int node_attrs(Node *n, char *buf, size_t size, void * /*arg*/)
 {
-  const size_t buf_sz = 1024;
-  static char attr_str[buf_sz];
-  snprintf(attr_str, buf_sz, "[label=\"%d\", style=filled, color=%s]",
+  return snprintf(buf, size, "[label=\"%d\", style=filled, color=%s]",
     *(int*)(n->data), (n->color == BTREE_RED)? "red" : "gray");
-  return attr_str;
-}
-
-static char* node_dump(Node *n)
-{
-  const size_t buf_sz = 1024;
-  static char str[buf_sz];
-  if (n != NULL)
-    snprintf(str, buf_sz, "%3d%c", *(int*)(n->data), (n->color == BTREE_RED)? 'r' : 'b');
-  else
-    snprintf(str, buf_sz, "NILb");
-  return str;
 }
 
+/*
+ * Usage: draw N [MAX_DEPTH [MAX_NODES]]. Inserts N random keys, removes
+ * half of them and writes the tree in dot format to stdout.
+ */
 int main(int argc, char **argv)
 {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s N [MAX_DEPTH [MAX_NODES]]\n", argv[0]);
+    return 1;
+  }
   BTree *tree = btree_create(int_compare);
   int n = atoi(argv[1]);
-  int a[n];
-  //int a[] = {1, 3, 2, 5, -1, 19, 15, 45, 9, 6, -4};
-  n = sizeof(a) / sizeof(a[0]);
-  //n = 3;
+  int max_depth = (argc > 2)? atoi(argv[2]) : -1;
+  size_t max_nodes = (argc > 3)? strtoull(argv[3], NULL, 10) : 0;
+  int *a = (int*)malloc(sizeof(int) * n);
   for (int i = 0; i < n; ++i) {
-    //a[i] = i + 1;
-    a[i] = rand() % 1000;
+    a[i] = rand() % (n < 100? 1000 : 10 * n);
     btree_insert(tree, (void*)&a[i]);
   }
   for (int i = 0; i < n / 2; ++i) {
     btree_remove(btree_find(tree, &a[i]));
   }
-  int expected_height = 2 * ceil(log(n + 1) / log(2)) + 1;
-  btree_dump_dot(tree, node_attrs);
+  bool ok = btree_dump_dot_to(tree, btree_file_writer(stdout), node_attrs, NULL, max_depth, max_nodes);
   btree_destroy(tree);
-}
\ No newline at end of file
+  free(a);
+  return ok? 0 : 1;
+}
@@ -0,0 +1,253 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "btree_arena.h"
+#include "btree_compact.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+
+static int int64_compare(void *va, void *vb)
+{
+  int64_t a = *(int64_t*)va;
+  int64_t b = *(int64_t*)vb;
+  return (a > b) - (a < b);
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The operations of a trace, on one of the tree implementations. */
+struct Backend {
+  const char *name;
+  void* (*create)();
+  void (*insert)(void *t, int64_t *key);
+  bool (*find)(void *t, int64_t *key);
+  void (*remove)(void *t, int64_t *key);
+  bool (*begin)(void *t, void **it);
+  bool (*next)(void *t, void **it);
+  bool (*rbegin)(void *t, void **it);
+  bool (*prev)(void *t, void **it);
+  void (*destroy)(void *t);
+};
+
+static void* pointer_create() { return btree_create(int64_compare); }
+static void* int64_create() { return btree_create_keyed(BTREE_KEY_INT64); }
+
+static void* arena_create()
+{
+  BTree *tree = btree_create_keyed(BTREE_KEY_INT64);
+  if (tree == NULL || !btree_use_arena(tree, 0, BTREE_ARENA_THP)) {
+    fprintf(stderr, "arena: cannot set up the arena\n");
+    exit(1);
+  }
+  return tree;
+}
+
+static void tree_insert(void *t, int64_t *key) { btree_insert((BTree*)t, key); }
+static bool tree_find(void *t, int64_t *key) { return btree_member((BTree*)t, key); }
+static void tree_remove(void *t, int64_t *key) { btree_remove(btree_find((BTree*)t, key)); }
+
+static bool tree_begin(void *t, void **it)
+{
+  *it = btree_begin((BTree*)t).node;
+  return *it != NULL;
+}
+
+static bool tree_next(void *t, void **it)
+{
+  if (*it == NULL)
+    return false;
+  BTreeIterator cur = {(BTree*)t, (Node*)*it};
+  *it = btree_next(cur).node;
+  return *it != NULL;
+}
+
+static bool tree_rbegin(void *t, void **it)
+{
+  *it = btree_rbegin((BTree*)t).node;
+  return *it != NULL;
+}
+
+static bool tree_prev(void *t, void **it)
+{
+  if (*it == NULL)
+    return false;
+  BTreeIterator cur = {(BTree*)t, (Node*)*it};
+  *it = btree_prev(cur).node;
+  return *it != NULL;
+}
+
+static void tree_destroy(void *t) { btree_destroy((BTree*)t); }
+
+static void* compact_create() { return btree_compact_create(int64_compare); }
+static void compact_insert(void *t, int64_t *key) { btree_compact_insert((BTreeCompact*)t, key); }
+static bool compact_find(void *t, int64_t *key) { return btree_compact_member((BTreeCompact*)t, key); }
+static void compact_remove(void *t, int64_t *key) { btree_compact_remove((BTreeCompact*)t, key); }
+
+static bool compact_begin(void *t, void **it)
+{
+  *it = (void*)(uintptr_t)btree_compact_begin((BTreeCompact*)t);
+  return *it != (void*)BTREE_NIL;
+}
+
+static bool compact_next(void *t, void **it)
+{
+  uint32_t i = (uint32_t)(uintptr_t)*it;
+  if (i == BTREE_NIL)
+    return false;
+  *it = (void*)(uintptr_t)btree_compact_next((BTreeCompact*)t, i);
+  return *it != (void*)BTREE_NIL;
+}
+
+static bool compact_rbegin(void *t, void **it)
+{
+  *it = (void*)(uintptr_t)btree_compact_rbegin((BTreeCompact*)t);
+  return *it != (void*)BTREE_NIL;
+}
+
+static bool compact_prev(void *t, void **it)
+{
+  uint32_t i = (uint32_t)(uintptr_t)*it;
+  if (i == BTREE_NIL)
+    return false;
+  *it = (void*)(uintptr_t)btree_compact_prev((BTreeCompact*)t, i);
+  return *it != (void*)BTREE_NIL;
+}
+
+static void compact_destroy(void *t) { btree_compact_destroy((BTreeCompact*)t); }
+
+static const Backend backends[] = {
+  {"pointer", pointer_create, tree_insert, tree_find, tree_remove, tree_begin, tree_next,
+   tree_rbegin, tree_prev, tree_destroy},
+  {"int64", int64_create, tree_insert, tree_find, tree_remove, tree_begin, tree_next,
+   tree_rbegin, tree_prev, tree_destroy},
+  {"arena", arena_create, tree_insert, tree_find, tree_remove, tree_begin, tree_next,
+   tree_rbegin, tree_prev, tree_destroy},
+  {"compact", compact_create, compact_insert, compact_find, compact_remove, compact_begin,
+   compact_next, compact_rbegin, compact_prev, compact_destroy},
+};
+
+/*
+ * Replays recs[0, n) on a new tree of backend 'b' and returns the seconds
+ * spent. Snapshot records, which come first, only load the tree and are
+ * not timed.
+ */
+static double run(const Backend *b, BTreeTraceRecord *recs, size_t n, BTreeHistogram *hist)
+{
+  void *t = b->create();
+  void *it = NULL;
+  size_t i = 0;
+  for (; i < n && recs[i].op == BTREE_TRACE_SNAPSHOT; ++i)
+    b->insert(t, &recs[i].key);
+  uint64_t begin = now_ns();
+  for (; i < n; ++i) {
+    uint64_t start = (hist != NULL)? now_ns() : 0;
+    switch (recs[i].op) {
+    case BTREE_TRACE_INSERT: b->insert(t, &recs[i].key); break;
+    case BTREE_TRACE_FIND: b->find(t, &recs[i].key); break;
+    case BTREE_TRACE_REMOVE: b->remove(t, &recs[i].key); break;
+    case BTREE_TRACE_BEGIN: b->begin(t, &it); break;
+    case BTREE_TRACE_NEXT: b->next(t, &it); break;
+    case BTREE_TRACE_SNAPSHOT: b->insert(t, &recs[i].key); break;
+    case BTREE_TRACE_RBEGIN: b->rbegin(t, &it); break;
+    case BTREE_TRACE_PREV: b->prev(t, &it); break;
+    }
+    if (hist != NULL)
+      btree_stats_record(&hist[recs[i].op], now_ns() - start);
+  }
+  double sec = (now_ns() - begin) / 1e9;
+  b->destroy(t);
+  return sec;
+}
+
+/*
+ * Usage: replay TRACE [BACKEND]. Replays a trace written by btree_trace_*
+ * once at full speed for throughput and once timing every operation for
+ * latency. BACKEND is one of pointer, int64, arena, compact or all.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s TRACE [pointer|int64|arena|compact|all]\n", argv[0]);
+    return 1;
+  }
+  const char *only = (argc > 2)? argv[2] : "all";
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (!btree_trace_read_header(in)) {
+    fprintf(stderr, "%s: not a trace\n", argv[1]);
+    fclose(in);
+    return 1;
+  }
+  size_t n = 0, cap = 1024;
+  BTreeTraceRecord *recs = (BTreeTraceRecord*)malloc(sizeof(BTreeTraceRecord) * cap);
+  BTreeTraceRecord rec = {BTREE_TRACE_INSERT, 0, 0};
+  while (recs != NULL && btree_trace_read(in, &rec)) {
+    if (n == cap) {
+      BTreeTraceRecord *grown =
+          (BTreeTraceRecord*)realloc(recs, sizeof(BTreeTraceRecord) * cap * 2);
+      if (grown == NULL) {
+        free(recs);
+        recs = NULL;
+        break;
+      }
+      recs = grown;
+      cap *= 2;
+    }
+    recs[n++] = rec;
+  }
+  fclose(in);
+  if (recs == NULL) {
+    fprintf(stderr, "%s: out of memory after %zu records\n", argv[1], n);
+    return 1;
+  }
+  size_t loaded = 0;
+  while (loaded < n && recs[loaded].op == BTREE_TRACE_SNAPSHOT)
+    loaded += 1;
+  printf("%zu elements at start, %zu operations recorded over %.3f s\n", loaded, n - loaded,
+         rec.time_ns / 1e9);
+
+  static const char *op_names[] = {"insert", "find", "remove", "begin", "next", "snapshot",
+                                   "rbegin", "prev"};
+  const int nops = sizeof(op_names) / sizeof(op_names[0]);
+  BTreeHistogram *hist = (BTreeHistogram*)malloc(sizeof(BTreeHistogram) * nops);
+  if (hist == NULL) {
+    fprintf(stderr, "out of memory\n");
+    free(recs);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    const Backend *b = &backends[i];
+    if (strcmp(only, "all") != 0 && strcmp(only, b->name) != 0)
+      continue;
+    double sec = run(b, recs, n, NULL);
+    if (n == loaded || sec <= 0)
+      printf("%-8s %10.3f s  (no operations timed)\n", b->name, sec);
+    else
+      printf("%-8s %10.3f s  %8.2f Mops/s\n", b->name, sec, (n - loaded) / sec / 1e6);
+    memset(hist, 0, sizeof(BTreeHistogram) * nops);
+    run(b, recs, n, hist);
+    for (int op = 0; op < nops; ++op) {
+      if (hist[op].total == 0)
+        continue;
+      printf("  %-7s p50 %llu ns  p99 %llu ns  p999 %llu ns  max %llu ns\n", op_names[op],
+             (unsigned long long)btree_stats_percentile(&hist[op], 0.5),
+             (unsigned long long)btree_stats_percentile(&hist[op], 0.99),
+             (unsigned long long)btree_stats_percentile(&hist[op], 0.999),
+             (unsigned long long)hist[op].max);
+    }
+  }
+  free(hist);
+  free(recs);
+  return 0;
+}